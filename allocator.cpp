@@ -10,9 +10,31 @@
 /* For new and delete */
 #include <new>
 
+/* Backtraces of the heap profiler - The unwinder of libgcc directly, backtrace() can allocate */
+#include <unwind.h>
+
 /* Activates debug mode */
 //#define DEBUG
 
+/* Activates hugepage mode by default - XMALLOC_HUGEPAGES=0/1 overrides it at load time */
+//#define HUGEPAGE_DEFAULT_ACTIVE
+
+/* Purges with MADV_FREE instead of MADV_DONTNEED - Cheaper, but RSS only drops under memory pressure */
+//#define PURGE_LAZY
+
+/* Object caches per CPU instead of per thread, through restartable sequences - x86-64 only. When glibc did not
+ * register rseq for the threads, the thread caches are used as usual */
+//#define PERCPU_CACHE_ACTIVE
+
+#if defined(PERCPU_CACHE_ACTIVE) && !defined(__x86_64__)
+    #undef PERCPU_CACHE_ACTIVE
+#endif
+
+/* Restartable sequences area of the threads - Registered by glibc */
+#ifdef PERCPU_CACHE_ACTIVE
+#include <sys/rseq.h>
+#endif
+
 /* Static assertion used for debugging */
 #define CTC(x) ({ extern int __attribute__((error("assertion failure: '" #x "' not true"))) compile_time_check(); ((x)?0:compile_time_check()),0; })
 
@@ -22,30 +44,152 @@
 /* Page block management */
 static void *mmap_wrap(size_t page_num);
 static void munmap_wrap(const void *block, const size_t page_num);
-static void *get_pageblock(size_t page_num);
+static void *mremap_wrap(void *block, const size_t old_page_num, const size_t new_page_num);
+static void *get_pageblock(const size_t page_num, unsigned int *zeroed_off);
 static void ret_pageblock(const void *block, const size_t page_num);
 
+/* Arena layer - Where pageblocks come from and go to when the caches are full */
+static char *mmap_arena(const unsigned int node);
+static int arena_grow(const unsigned int node, const uintptr_t old_bump);
+static void *arena_alloc(const unsigned int node, const size_t page_num, unsigned int *zeroed_off);
+static void arena_scatter(const unsigned int node, char *start, const char *end);
+static void arena_retire(void *block, const size_t page_num);
+static void arena_map_set(char *block, const size_t page_num);
+
+/* NUMA nodes - Each one has its own arenas and global pageblock caches */
+static unsigned int possible_detect(const char *path);
+static unsigned int numa_nodes_detect(void);
+static unsigned int numa_node_current(unsigned int *shard);
+
+/* Global pageblock caches - Our shard of a node first, then its other shards */
+static page_t *global_cache_remove(const unsigned int node, const unsigned int shard, const int page_class_idx);
+static int global_cache_insert(void *block, const unsigned int shard, const int page_class_idx);
+static void global_cache_insert_chain(dq_ct_node *chain, const unsigned int node, const unsigned int shard, const int page_class_idx);
+
+/* Purging of idle cached pageblocks - Their first page (header and links) always stays resident */
+static unsigned long int clock_ms(void);
+static void pageblock_stamp(void *block, const size_t page_num, const unsigned long int now);
+static int pageblock_purge(void *block, const size_t page_num);
+static int cache_purge(dq_ct_node *stack, const size_t page_num, const unsigned long int cutoff, const int shared);
+static void purge_tick(const unsigned long int now);
+
+/* Statistics - Counters are per thread and summed on demand */
+static void stats_collect(const struct thread_data_struct *thread, xmalloc_stats_t *stats);
+static size_t resident_bytes(void);
+
 /* Class sizes decoders */
 static int class_size_decode(const size_t size, int *pageblock_size);
+static int large_class_decode(const size_t page_num, size_t *bin_page_num);
 static int object_type_decode(const void *obj, int *page_offset);
+static inline int object_page_decode(const void *obj, page_t **page);
 
 /* Header related */
+#ifndef HEADERLESS_ACTIVE
 static void header_write_small(const page_t *page, char *obj);
+#endif
 static void header_write_large(char *obj, size_t sz);
 
 /* Pageblock internal operations */
-static page_t *page_internal_init(const void *alloc, const int object_class_idx, const int page_num, const unsigned int thread_id);
+static unsigned int page_objects_off(const int page_num, const unsigned int object_size);
+static page_t *page_internal_init(const void *alloc, const int object_class_idx, const int page_num, const unsigned int zeroed_off, const unsigned int thread_id, page_t *volatile *notify);
 static void *page_internal_alloc(page_t *page);
-static void page_internal_free(heap_t *local_heap, page_t *page, char *obj, const unsigned int thread_id);
+static void *page_internal_bump(page_t *page);
+static void page_internal_free(struct thread_data_struct *local_data, page_t *page, char *obj);
+static void page_remote_free(struct thread_data_struct *local_data, page_t *page, const unsigned int head_off, char *tail, const unsigned int count);
+
+/* Available/full lists of the local heap */
+static int page_park(heap_t *local_heap, page_t *page);
+static int page_unpark(heap_t *local_heap, page_t *page);
+static int heap_collect_notified(heap_t *local_heaps, page_t *volatile *notified);
+static void heap_keep_empty(struct thread_data_struct *local_data, page_t *page);
+static int heap_release_empty(struct thread_data_struct *local_data, const int class_idx, const unsigned int kept);
+
+/* Orphaned pageblocks of exited threads - Pooled per class until adopted or stolen */
+static int orphan_adopt(heap_t *local_heap, const int class_idx);
+static void orphan_unpool(page_t *page, const int class_idx);
+
+/* Small objects allocations from the pageblocks */
+static void *small_alloc(heap_t *local_heap, const int class_idx, const int page_num);
+static inline void small_free(void *obj, const int class_idx);
+#ifdef FREE_CHECK_ACTIVE
+static void free_check_abort(void) __attribute__((noreturn, noinline, cold));
+static inline void *free_check_cache_in(void *obj);
+static inline void *free_check_cache_out(void *obj);
+#endif
+
+/* Thread cache operations - Slow paths are kept out of line */
+static void *tcache_refill(tcache_t *cache, heap_t *local_heap, const int class_idx, const int page_num, const size_t size) __attribute__((noinline));
+static void tcache_drain(struct thread_data_struct *local_data, const int class_idx, const unsigned int objects_num) __attribute__((noinline));
+static inline void remote_chain_add(remote_chain_t *chains, unsigned int *chains_num, struct thread_data_struct *local_data, page_t *page, char *obj,
+                                    const unsigned int obj_offset);
+
+/* Forking - Global locks are held across fork, the child reclaims the heaps of the threads it did not inherit */
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+static int fork_reclaim(void);
+static void fork_settle(heap_t *local_heaps);
+
+/* Per-CPU caches - The thread caches only stage the objects that move from/to the pageblocks */
+#ifdef PERCPU_CACHE_ACTIVE
+static void percpu_init(void);
+static inline void *percpu_pop(const int class_idx);
+static inline int percpu_push(const int class_idx, void *obj);
+static void *percpu_refill(tcache_t *cache, heap_t *local_heap, const int class_idx, const int page_num, const size_t size) __attribute__((noinline));
+static void percpu_drain(tcache_t *cache, const int class_idx, void *obj) __attribute__((noinline));
+#endif
 
 /* Large objects allocations manipulation */
-static void *large_alloc(const size_t size);
+static void *large_alloc(const size_t size, const int zero);
 static void large_free(const void *obj);
+static void *large_realloc(void *obj, const size_t size);
+static void *large_aligned_alloc(const size_t size, const size_t alignment);
+static size_t large_usable_size(const void *obj);
+
+/* Aligned allocations - From the classes aligned at the request, or page aligned large allocations */
+static size_t aligned_small_size(const size_t alignment, const size_t size);
+static void *aligned_malloc(const size_t alignment, const size_t size);
+
+static void large_global_release(void *block, const int bin_idx);
+
+/* Runtime configuration - XMALLOC_CONF, applied before the first allocation */
+static void conf_load(void);
+static void conf_parse(const char *conf);
+static void conf_small_limit(const size_t limit);
+
+/* Heap profiling - Sampled objects are large allocations, so frees find them through their header */
+static void *large_alloc_sampled(const size_t size, const int zero);
+static inline int prof_due(const size_t bytes);
+static void *prof_sample_small(tcache_t *cache, void *obj, const size_t size, const int zero) __attribute__((noinline));
+static void prof_sample_large(void *obj, const size_t size) __attribute__((noinline));
+static void prof_record(void *obj, const size_t size);
+static void prof_remove(const void *obj);
+static void prof_move(const void *old_obj, void *new_obj, const size_t size);
 
 /********************************* GLOBAL VARS ***************************/
 
+/* Runtime configuration - Set once, before the first pageblock. Requests below small_limit are served by the first
+ * small_classes classes, the rest of the classes always miss the thread cache and go large */
+static int conf_loaded = 0;
+static size_t small_limit = SMALL_ALLOCATION_LIMIT;
+static int small_classes = CLASS_NUM;
+static unsigned int page_multiplier = PAGE_MULTIPLIER;
+static unsigned int tcache_depth = TCACHE_DEPTH;
+static unsigned long int global_cache_depth = COUNT_MAX;
+static unsigned long int local_cache_depth = LOCAL_CACHE_DEPTH;
+static unsigned int empty_pageblocks = EMPTY_PAGEBLOCKS;
+static size_t large_local_cache = LARGE_LOCAL_CACHE_SZ;
+static size_t large_global_cache = LARGE_GLOBAL_CACHE_SZ;
+
+/* Per-CPU caches - CLASS_NUM caches per CPU, the ones of a CPU are page aligned. NULL until they are in use */
+#ifdef PERCPU_CACHE_ACTIVE
+static char *percpu_caches = NULL;
+static size_t percpu_stride = 0;
+static unsigned int percpu_cpus = 0;
+#endif
+
 /* These are the class sizes including the needed header for each object */
-const static int class_sizes[] =
+static constexpr int class_sizes[] =
 {
     /* 1st set of classes - Offset 16 bytes */
     16, 32, 48, 64, 80, 96, 112, 128,
@@ -62,11 +206,119 @@ const static int class_sizes[] =
     1600, 1664, 1728, 1792, 1856, 1920, 1984, 2048
 };
 
-/* Global pageblock freelists */
-static dq_ct_node global_freeheap[CLASS_PAGES_NUM] = {0};
+/* Class lookup table - Built at compile time from the class sizes, so that malloc decodes a class with one load */
+typedef struct class_lut_struct
+{
+    unsigned char entries[CLASS_LUT_SIZE];
+}class_lut_t;
+
+/* The classes are split in 3 ranges of 16, 32 and 64 byte offsets, [1-512], [513-1024] and [1025-2048] bytes.
+ * Entry i is the smallest class that holds 16 * i bytes, with its range next to it (the pageblock size shift). */
+static constexpr class_lut_t class_lut_build(void)
+{
+    class_lut_t lut = {};
+    int class_idx = 0;
+
+    for(int i = 0; i < CLASS_LUT_SIZE; i++)
+    {
+        while(class_sizes[class_idx] < 16 * i) class_idx++;
+
+        const int range_idx = (class_sizes[class_idx] > 512) + (class_sizes[class_idx] > 1024);
+        lut.entries[i] = (unsigned char)(class_idx | (range_idx << CLASS_LUT_RANGE_SHIFT));
+    }
+
+    return lut;
+}
+
+static constexpr class_lut_t class_lut = class_lut_build();
+
+static_assert(sizeof(class_sizes) / sizeof(class_sizes[0]) == CLASS_NUM, "A class size for every class");
+static_assert(class_sizes[CLASS_NUM - 1] == 16 * (CLASS_LUT_SIZE - 1), "The lookup table ends at the largest class");
+static_assert(CLASS_NUM <= (1 << CLASS_LUT_RANGE_SHIFT), "Class indexes fit below the range of an entry");
+
+/* Global pageblock freelists - One set per NUMA node, every stack sharded and alone in its cache line */
+typedef struct global_shard_struct
+{
+    dq_ct_node top;
+} __attribute__((aligned(CACHE_LINE_SZ))) global_shard_t;
+
+static global_shard_t global_freeheap[NUMA_NODES_MAX][CLASS_PAGES_NUM][GLOBAL_SHARDS] = {0};
+
+/* Global large allocation bins - Counting stacks under a lock, blocks in there can be unmapped. Their bytes are reserved
+ * before an insertion, the budget is shared by all the bins */
+static dq_ct_node global_large_freeheap[LARGE_CLASS_NUM] = {0};
+static spin_t global_large_lock[LARGE_CLASS_NUM] = {0};
+static volatile size_t global_large_cached = 0;
 
-/* Thread ID counter - Sequentially given to each new thread created */
+/* Thread ID counter - Sequentially given to each new thread created, unless an exited one left its ID */
 static unsigned int global_thread_id = 0;
+static unsigned int recycled_ids[THREAD_IDS_RECYCLED];
+static unsigned int recycled_ids_num = 0;
+static spin_t recycled_ids_lock = 0;
+
+/* Orphaned pageblocks with live objects - Linked through their list links, exited threads do not need them */
+static page_list_t orphan_pool[CLASS_NUM] = {0};
+static spin_t orphan_lock[CLASS_NUM] = {0};
+
+/* Hugepage mode - Arenas are advised for transparent huge pages */
+#ifdef HUGEPAGE_DEFAULT_ACTIVE
+    static int hugepage_mode = 1;
+#else
+    static int hugepage_mode = 0;
+#endif
+
+/* NUMA nodes in use - 1 means no NUMA awareness at all */
+static unsigned int numa_nodes = 1;
+
+/* Current arena of each node and its used pages, packed as | Arena base (ARENA_SZ aligned) | Used pages | for lock-free bumps */
+static volatile uintptr_t arena_bump[NUMA_NODES_MAX] = {0};
+static spin_t arena_lock[NUMA_NODES_MAX] = {0};
+
+/* Retired pageblocks - Overflow of the global caches, purged and linked through their first bytes */
+static spin_t retired_lock = 0;
+static void *retired_heap[NUMA_NODES_MAX][CLASS_PAGES_NUM] = {0};
+
+#ifdef HEADERLESS_ACTIVE
+/* Headerless mode - One bit for every arena aligned slot of the address space, set if it is one of our arenas */
+static unsigned long int arena_slots[ARENA_SLOTS / (8 * sizeof(unsigned long int))] = {0};
+#endif
+
+/* Statistics - Registry of the live threads, totals of the exited ones and mapped bytes */
+static struct thread_data_struct *thread_registry = NULL;
+static spin_t registry_lock = 0;
+static long int exited_live[CLASS_NUM] = {0};
+static class_stats_t exited_stats[CLASS_NUM] = {0};
+static large_stats_t exited_large_stats = {0};
+static long int stats_mapped = 0;
+
+/* Heap profiling - Sampling interval in allocated bytes (0 disables it) and the live samples, hashed by object */
+typedef struct prof_sample
+{
+    const void *obj;
+    size_t size;
+    unsigned int depth;
+    struct prof_sample *next;
+    void *stack[PROF_DEPTH];
+}prof_sample_t;
+
+static long int prof_interval = 0;
+static spin_t prof_lock = 0;
+static prof_sample_t *prof_table[PROF_BUCKETS] = {0};
+static prof_sample_t *prof_unused = NULL;
+static long int prof_total_samples = 0, prof_total_bytes = 0;
+
+/* Purging - Decay time (negative disables it, 0 purges right away) and the last pass over the global caches */
+static long int purge_decay_ms = PURGE_DECAY_MS;
+static volatile unsigned long int purge_last = 0;
+static spin_t purge_lock = 0;
+
+/* Forking - Copies of the threads a child did not inherit, their heaps are reclaimed away from the fork itself, and
+ * the forking thread, whose parked pageblocks are settled there too. Set in the child until then. */
+static struct thread_data_struct *fork_stale = NULL;
+static struct thread_data_struct *volatile fork_self = NULL;
+static void *fork_copies = NULL;
+static size_t fork_copies_pages = 0;
+static spin_t fork_lock = 0;
 
 /********************************* THREAD LOCAL VARS ***************************/
 
@@ -76,77 +328,216 @@ typedef struct thread_data_struct
     unsigned int thread_id;                        /* The thread ID */
     heap_t private_heap[CLASS_NUM];                /* The local heap with all the classes of small objects */
     dq_ct_node top[CLASS_PAGES_NUM];               /* Local pageblock free lists - Local caching */
+    page_t *volatile notified;                     /* Parked pageblocks that got remote frees - Pushed by other threads */
+    tcache_t cache[CLASS_NUM];                     /* Objects ready to be handed out - In front of the pageblocks */
+    dq_ct_node large_top[LARGE_CLASS_NUM];         /* Local large allocation bins - Local caching */
+    size_t large_cached;                           /* Bytes in the local large bins - Up to large_local_cache */
+    unsigned long int purge_last;                  /* Last purge pass over the local pageblock caches */
+    class_stats_t stats[CLASS_NUM];                /* Statistics of the small classes - Object counts are in the caches */
+    large_stats_t large_stats;                     /* Statistics of the large allocations */
+    struct thread_data_struct *reg_next, *reg_prev;/* Links in the thread registry */
+    long int prof_left;                            /* Bytes to allocate until the next heap profiling sample */
+    unsigned int prof_seed;                        /* Randomizes the sampling intervals */
+    unsigned char prof_busy;                       /* Taking a sample - Nothing is sampled in there */
+    unsigned char releasing;                       /* Giving everything back - Its lists are not walked twice */
+    unsigned char busy;                            /* Nesting of the slow paths it is in - See thread_busy_t */
 
     /* Default Constructor - Called when thread spawns */
     thread_data_struct()
     {
+        /* The first thread comes before the constructors of the library, if others allocated in theirs */
+        conf_load();
+
         /* Set pointers all pointers to NULL and get a unique ID */
         memset(this->private_heap, 0, CLASS_NUM * sizeof(heap_t));
         memset(this->top, 0, CLASS_PAGES_NUM * sizeof(dq_ct_node));
-        this->thread_id = ATOMIC_ADD(&global_thread_id, 1);
+        memset(this->large_top, 0, LARGE_CLASS_NUM * sizeof(dq_ct_node));
+        this->large_cached = 0;
+        memset(this->cache, 0, CLASS_NUM * sizeof(tcache_t));
+        for(int i = 0; i < CLASS_NUM; i++) this->cache[i].depth = tcache_depth;
+        memset(this->stats, 0, CLASS_NUM * sizeof(class_stats_t));
+        memset(&this->large_stats, 0, sizeof(large_stats_t));
+        this->notified = NULL;
+        this->purge_last = 0;
+        this->prof_left = 0;
+        this->prof_busy = 0;
+        this->releasing = 0;
+        this->busy = 0;
+
+        /* IDs of exited threads first - No pageblock is owned by them anymore */
+        spin_lock(&recycled_ids_lock);
+        this->thread_id = recycled_ids_num ? recycled_ids[--recycled_ids_num] : 0;
+        spin_unlock(&recycled_ids_lock);
+
+        if(!this->thread_id) this->thread_id = ATOMIC_ADD(&global_thread_id, 1, __ATOMIC_RELAXED);
+        if(this->thread_id >= ORPHAN_ID) PANIC_ERR("Out of thread IDs, aborting..\n");
+
+        this->prof_seed = this->thread_id * 2654435761U;
+
+        /* Visible to the statistics from now on */
+        spin_lock(&registry_lock);
+
+        this->reg_prev = NULL;
+        this->reg_next = thread_registry;
+        if(thread_registry) thread_registry->reg_prev = this;
+        thread_registry = this;
+
+        spin_unlock(&registry_lock);
+
+        /* In a forked child we can be in the TLS of a thread left behind - What it was notified of is not ours */
+        if(fork_reclaim()) this->notified = NULL;
     }
 
     /* Default Destructor - Called when thread terminates (during cleanup phase) */
     ~thread_data_struct()
     {
+        /* Forked children - The forking thread may exit before any other slow path of it */
+        fork_reclaim();
+
+        this->release();
+    }
+
+    /* Gives everything back - Pageblocks with live objects are orphaned, the rest is cached. Also used by forked
+     * children on the threads left behind, the caches of the pageblocks are the ones of the calling thread. */
+    void release(void)
+    {
+        unsigned int shard;
+        numa_node_current(&shard);
+
+        this->releasing = 1;
+
+        /* Cached objects go back to their pageblocks first */
+        for(int i = 0; i < CLASS_NUM; i++)
+            tcache_drain(this, i, this->cache[i].count);
+
         for(int i = 0; i < CLASS_NUM; i++) /* Traverse array of classes */
         {
-            heap_t *bin = &this->private_heap[i];
+            page_list_t *lists[] = {&this->private_heap[i].avail, &this->private_heap[i].full, &this->private_heap[i].empty};
             page_t *next = NULL;
 
-            for(page_t *cur = bin->head; cur; cur = next) /* Traverse each class list of pageblocks */
+            for(int l = 0; l < 3; l++) /* Available, full and empty pageblocks of the class */
+            for(page_t *cur = lists[l]->head; cur; cur = next) /* Traverse each class list of pageblocks */
             {
+                rfid_un old_head, new_head;
                 next = cur->next;
 
+                /* A remote free might still be notifying us - Wait for it to finish */
+                PAGE_SYNC_SETTLED(cur, old_head);
+
                 /* There are still objects in the pageblock */
-                if(cur->allocated_objects && cur->sync.shared.count != cur->allocated_objects)
+                if(cur->allocated_objects && old_head.shared.count != cur->allocated_objects)
                 {
-                    rfid_un old_head, new_head;
+                    int orphaned = 0;
+
+                    /* Under the pool lock - Whoever steals it next finds it pooled */
+                    spin_lock(&orphan_lock[i]);
 
                     do
                     {
-                        /* Fix next */
-                        old_head.both = cur->sync.both;
+                        /* Fix next - Same as above, wait for any notification */
+                        PAGE_SYNC_SETTLED(cur, old_head);
 
                         /* Means block is completely free now */
                         if(old_head.shared.count == cur->allocated_objects)
-                            goto block_empty;
+                            break;
 
-                        /* New head should have orphan ID */
+                        /* New head should have orphan ID - Nobody notifies orphans */
                         new_head = old_head;
                         new_head.shared.thread_id = ORPHAN_ID;
+                        new_head.shared.state = PAGE_STATE_NONE;
                     }
-                    while(!ATOMIC_CAS(&cur->sync.both, &new_head.both, &old_head.both));
+                    while(!(orphaned = ATOMIC_CAS(&cur->sync.both, &new_head.both, &old_head.both, __ATOMIC_RELEASE)));
+
+                    /* Block was orphaned - Pooled for adoption, next one */
+                    if(orphaned)
+                    {
+                        insert_front_dq(&orphan_pool[i], cur);
+                        cur->pooled = 1;
+                    }
+
+                    spin_unlock(&orphan_lock[i]);
 
-                    /* Block was orphaned - Next one */
-                    continue;
+                    if(orphaned) continue;
                 }
 
-                block_empty: /* JUMPTAG */
+                /* Release back - Cached from now on */
+                pageblock_stamp(cur, cur->page_num, clock_ms());
+                this->stats[i].pageblocks--;
 
-                /* Release back to global freelist or to the OS */
-                if(!stack_insert_atomic(&global_freeheap[IDX_BY_PAGE_SZ(cur->page_num)], cur))
-                    munmap_wrap(cur, cur->page_num);
+                /* Release back to global freelist or to the arenas */
+                if(!global_cache_insert(cur, shard, IDX_BY_PAGE_SZ(cur->page_num)))
+                    arena_retire(cur, cur->page_num);
             }
         }
 
         for(int i = 0; i < CLASS_PAGES_NUM; i++) /* Traverse array of cached page classes */
         {
+            dq_ct_node chains[NUMA_NODES_MAX] = {0};
+
             while(!stack_is_empty(&this->top[i])) /* Remove from page class list every pageblock */
             {
                 page_t *cur = stack_remove(&this->top[i]);
-
-                /* Release back to global freelist or to the OS */
-                if(!stack_insert_atomic(&global_freeheap[i], cur))
-                    munmap_wrap(cur, PAGE_SZ_BY_IDX(i));
+                stack_insert(&chains[cur->node], cur);
             }
+
+            /* Release back to global freelist of their node at once or to the arenas */
+            for(unsigned int n = 0; n < numa_nodes; n++)
+                global_cache_insert_chain(&chains[n], n, shard, i);
+        }
+
+        for(int i = 0; i < LARGE_CLASS_NUM; i++) /* Traverse array of cached large bins */
+        {
+            while(!stack_is_empty(&this->large_top[i])) /* Release back to global bins or to the OS */
+                large_global_release(stack_remove(&this->large_top[i]), i);
+        }
+
+        /* Statistics are kept in the exited totals */
+        spin_lock(&registry_lock);
+
+        for(int i = 0; i < CLASS_NUM; i++)
+        {
+            exited_live[i] += this->cache[i].allocs - this->cache[i].frees;
+            exited_stats[i].pageblocks += this->stats[i].pageblocks;
+            exited_stats[i].remote_frees += this->stats[i].remote_frees;
+            exited_stats[i].steals += this->stats[i].steals;
         }
+
+        exited_large_stats.allocs += this->large_stats.allocs;
+        exited_large_stats.frees += this->large_stats.frees;
+        exited_large_stats.pages += this->large_stats.pages;
+
+        if(this->reg_prev) this->reg_prev->reg_next = this->reg_next;
+        else thread_registry = this->reg_next;
+        if(this->reg_next) this->reg_next->reg_prev = this->reg_prev;
+
+        spin_unlock(&registry_lock);
+
+        /* Nothing is owned by our ID anymore - Next threads can have it */
+        spin_lock(&recycled_ids_lock);
+        if(recycled_ids_num < THREAD_IDS_RECYCLED) recycled_ids[recycled_ids_num++] = this->thread_id;
+        spin_unlock(&recycled_ids_lock);
     }
 
 }thread_private_t;
 
-/* Private thread data */
-static thread_local thread_private_t thread_data;
+/* Private thread data - Initial exec model since we are preloaded/linked, no __tls_get_addr in the fast paths */
+static thread_local thread_private_t thread_data __attribute__((tls_model("initial-exec")));
+
+/* Slow paths of a thread - A fork in the middle of them leaves its lists halfway, so the child does not walk them */
+typedef struct thread_busy_struct
+{
+    thread_busy_struct()
+    {
+        thread_data.busy++;
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    }
+
+    ~thread_busy_struct()
+    {
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        thread_data.busy--;
+    }
+}thread_busy_t;
 
 /********************************* DEBUG ONLY VARS AND MACROS ***************************/
 #ifdef DEBUG
@@ -157,9 +548,9 @@ static thread_local thread_private_t thread_data;
 #ifdef DEBUG_COUNT_FUNCTION_CALLS
     static long unsigned int total_malloc_ops = 0, total_realloc_ops = 0, total_free_ops = 0;
 
-    #define DEBUG_COUNT_MALLOCS()       (ATOMIC_ADD(&total_malloc_ops, 1))
-    #define DEBUG_COUNT_REALLOCS()      (ATOMIC_ADD(&total_realloc_ops, 1))
-    #define DEBUG_COUNT_FREES()         (ATOMIC_ADD(&total_free_ops, 1))
+    #define DEBUG_COUNT_MALLOCS()       (ATOMIC_ADD(&total_malloc_ops, 1, __ATOMIC_RELAXED))
+    #define DEBUG_COUNT_REALLOCS()      (ATOMIC_ADD(&total_realloc_ops, 1, __ATOMIC_RELAXED))
+    #define DEBUG_COUNT_FREES()         (ATOMIC_ADD(&total_free_ops, 1, __ATOMIC_RELAXED))
 #else
     #define DEBUG_COUNT_MALLOCS()
     #define DEBUG_COUNT_REALLOCS()
@@ -169,8 +560,8 @@ static thread_local thread_private_t thread_data;
 #ifdef DEBUG_COUNT_KERNEL_CALLS
     static long unsigned int total_mmap = 0, total_munmap = 0;
 
-    #define DEBUG_COUNT_MMAP()          (ATOMIC_ADD(&total_mmap, 1))
-    #define DEBUG_COUNT_MUNMAP()        (ATOMIC_ADD(&total_munmap, 1))
+    #define DEBUG_COUNT_MMAP()          (ATOMIC_ADD(&total_mmap, 1, __ATOMIC_RELAXED))
+    #define DEBUG_COUNT_MUNMAP()        (ATOMIC_ADD(&total_munmap, 1, __ATOMIC_RELAXED))
 #else
     #define DEBUG_COUNT_MMAP()
     #define DEBUG_COUNT_MUNMAP()
@@ -180,13 +571,13 @@ static thread_local thread_private_t thread_data;
     static long unsigned int total_alloc_mem = 0, total_dealloc_mem = 0, peak_mem = 0, total_real_alloc_mem = 0;
     static long unsigned int total_page_steals = 0;
 
-    #define DEBUG_TOTAL_STEALS()        (ATOMIC_ADD(&total_page_steals, 1))
-    #define DEBUG_TOTAL_ALLOC(x)        (ATOMIC_ADD(&total_alloc_mem, (x)))
-    #define DEBUG_TOTAL_DEALLOC(x)      (ATOMIC_ADD(&total_dealloc_mem, (x)))
-    #define DEBUG_REAL_TOTAL_ALLOC(x)   (ATOMIC_ADD(&total_real_alloc_mem, (x)))
+    #define DEBUG_TOTAL_STEALS()        (ATOMIC_ADD(&total_page_steals, 1, __ATOMIC_RELAXED))
+    #define DEBUG_TOTAL_ALLOC(x)        (ATOMIC_ADD(&total_alloc_mem, (x), __ATOMIC_RELAXED))
+    #define DEBUG_TOTAL_DEALLOC(x)      (ATOMIC_ADD(&total_dealloc_mem, (x), __ATOMIC_RELAXED))
+    #define DEBUG_REAL_TOTAL_ALLOC(x)   (ATOMIC_ADD(&total_real_alloc_mem, (x), __ATOMIC_RELAXED))
     #define DEBUG_PEAK_MEM()            do{     \
                                             long unsigned int __loc_var__ = total_alloc_mem - total_dealloc_mem; \
-                                            if(__loc_var__ > peak_mem) ATOMIC_STORE(&peak_mem, &__loc_var__);    \
+                                            if(__loc_var__ > peak_mem) ATOMIC_STORE(&peak_mem, &__loc_var__, __ATOMIC_RELAXED);    \
                                         }while(0)
 #else
     #define DEBUG_TOTAL_STEALS()
@@ -216,7 +607,9 @@ static void *mmap_wrap(size_t page_num)
     void *block = mmap(NULL, page_num * PAGE_SZ, MMAP_PROT_ARGS, MMAP_FLAGS_ARGS, -1, 0);
 
     /* MAP_FAILED is -1 - A small trick here is to do a branchless conditional set */
-    if(block == MAP_FAILED) block = NULL; //    block += (block == MAP_FAILED);
+    if(block == MAP_FAILED) return NULL; //    block += (block == MAP_FAILED);
+
+    ATOMIC_ADD(&stats_mapped, (long int)(page_num * PAGE_SZ), __ATOMIC_RELAXED);
 
     DEBUG_COUNT_MMAP();
     DEBUG_TOTAL_ALLOC(page_num * PAGE_SZ);
@@ -232,532 +625,3017 @@ static void munmap_wrap(const void *block, const size_t page_num)
     DEBUG_TOTAL_DEALLOC(page_num * PAGE_SZ);
 
     munmap((void*)block, page_num * PAGE_SZ);
+    ATOMIC_ADD(&stats_mapped, -(long int)(page_num * PAGE_SZ), __ATOMIC_RELAXED);
 }
 
-/* Gets pageblock from the page allocator */
-static void *get_pageblock(const size_t page_num)
+/* Wrapper for mremap system call - The mapping can move, its contents are kept without copying */
+static void *mremap_wrap(void *block, const size_t old_page_num, const size_t new_page_num)
 {
-    const unsigned int page_class_idx = IDX_BY_PAGE_SZ(page_num);
+    void *new_block = mremap(block, old_page_num * PAGE_SZ, new_page_num * PAGE_SZ, MREMAP_MAYMOVE);
 
-    /* 1st level - Local thread cache */
-     void *block = stack_remove(&thread_data.top[page_class_idx]);
+    if(new_block == MAP_FAILED) return NULL;
 
-    if(!block)
-    {
-        /* 2nd level - Global cache */
-        block = stack_remove_atomic(&global_freeheap[page_class_idx]);
+    ATOMIC_ADD(&stats_mapped, (long int)(new_page_num - old_page_num) * PAGE_SZ, __ATOMIC_RELAXED);
 
-        /* 3rd level - Request from the OS */
-        if(!block)  block = mmap_wrap(page_num);
-    }
+    DEBUG_COUNT_MMAP();
+    DEBUG_TOTAL_ALLOC((new_page_num - old_page_num) * PAGE_SZ);
+    DEBUG_PEAK_MEM();
 
-    return block;
+    return new_block;
 }
 
-/* Returns pageblock to the page allocator */
-static void ret_pageblock(const void *block, const size_t page_num)
+/* Gets pageblock from the page allocator - Also reports the offset from which its memory is known to be zero */
+static void *get_pageblock(const size_t page_num, unsigned int *zeroed_off)
 {
     const unsigned int page_class_idx = IDX_BY_PAGE_SZ(page_num);
 
-    /* 1st level of caching - Local thread cache */
-    if(stack_insert(&thread_data.top[page_class_idx], (page_t *) block))
-        return;
-
-    /* 2nd level of caching - Global cache */
-    if(!stack_insert_atomic(&global_freeheap[page_class_idx], (page_t *) block))
-        munmap_wrap(block, page_num);
-}
-
-/* Forms the header for a small allocation */
-static void header_write_small(const page_t *page, char *obj)
-{
-    /* Form the header */
-    header_t header = HEADER_SMALL | HEADER_VALID;
-
-    /* How many pages separate us from the start of the page */
-    const int page_offset = ((uintptr_t) ((obj - (char *)page))) >> PAGE_BITS;
-
-    /* Set the page offset value */
-    header |= HEADER_PAGE_OFFSET_SET(page_offset);
+    /* Forked children - The heaps of the threads left behind first */
+    fork_reclaim();
 
-    /* Write the header */
-    WRITE_HEADER(obj - sizeof(header_t), &header);
-}
+    /* 1st level - Local thread cache */
+    page_t *block = stack_remove(&thread_data.top[page_class_idx]);
 
-/* Forms the header for a large allocation. Assumes large allocations are page aligned. */
-static void header_write_large(char *obj, const size_t sz)
-{
-    /* Form the header */
-    const header_t header = HEADER_LARGE | HEADER_VALID;
+    unsigned int shard = 0;
+    const unsigned int node = block ? 0 : numa_node_current(&shard);
 
-    /* Write the large alloc size and the common header */
-    WRITE_LARGE_HEADER_SZ((size_t *)obj, &sz);
-    WRITE_HEADER(obj + LARGE_HEADER_SIZE - sizeof(header_t), &header);
-}
+    /* 2nd level - Global cache, of our node first and then stolen from the rest */
+    for(unsigned int i = 0; !block && i < numa_nodes; i++)
+        block = global_cache_remove((node + i) % numa_nodes, shard, page_class_idx);
 
-/* Decodes the type of object and checks if any corruption happened */
-static int object_type_decode(const void *obj, int *page_offset)
-{
-    const header_t header = GET_HEADER(obj);
+    purge_tick(clock_ms());
 
-    /* Write out the page offset - In case of large allocation this is ignored */
-    *page_offset = HEADER_PAGE_OFFSET_GET(header);
+    /* Cached pageblocks know how much of them was purged */
+    if(block)
+    {
+        *zeroed_off = block->zeroed_off;
+        return block;
+    }
 
-    /* Check validity */
-    return HEADER_IS_BLOCK_VALID(header) ? HEADER_PAGE_GET_TYPE(header) : -1;
+    /* 3rd level - Request from the arenas of our node */
+    return arena_alloc(node, page_num, zeroed_off);
 }
 
-/* Finds the real class size and returns index to it */
-static int class_size_decode(const size_t size, int *pageblock_size)
-{
-    /* Constants - Compiler will optimize away */
-    const unsigned int range_shift = 8 , range_mult = 512, base_shift = 4;
-    const unsigned int range_offset[] = {0, 32, 48};
-    unsigned int range_idx, subrange_idx;
-
-    /* Some notes since there is some hackery going on here.
-     *
-     * @Class layout
-     *
-     * There are 64 classes in total which are split into 2 levels and to find the final
-     * classes, 2 indexes are needed.
-     *
-     * @1st level:
-     * The first level is split in the total range we have, which is [1, 2047] and we split
-     * this in a non-uniform fashion with the following layout:
-     *      | [1-511] = Class0   | [512-1023] = Class1  | [1024-2047] = Class2  |
-     *      | 16-byte offsets    |   32-byte offsets    |    64-byte offsets    |
-     *
-     * Each class is then split into sub-classes where sizes are uniformly distributed with each
-     * sub-class having the class offset as a difference between each other.
-     *
-     * @2nd level:
-     * To understand it easier, for the second level here is an example:
-     *  - Assume an allocation request of 24 bytes.
-     *  - We go to the first class, Class0, so our first index is 0.
-     *  - Inside class 0 we have the following layout:
-     *      | [1 - 15] bytes | [16 - 31] bytes | [32 - 47] bytes | ..(more classes).. | [240 - 255] bytes |
-     *      |  Sub-class0    |   Sub-class1    |   Sub-class2    |     .......        |    Sub-class15    |
-     *
-     *  - Our request fits inside Sub-class1, so we go there.
-     *
-     * @Finalize:
-     * When we have both indexes we can calculate the base of the first class (where it starts in the
-     * array of bins of each thread) and add to it the sub-range, to get the final index.
-     * */
-
-    /* Get the first level class index */
-    range_idx = LOG2((size >> range_shift) | 1);                                    /* log2(size / 256 | 1) (OR 1 is used since log(0) is undefined) */
-
-    /* Get the second level class index */
-    subrange_idx = (size - range_mult * range_idx) >> (base_shift + range_idx);     /* (Size - Range_min) / (16 + Range_divider) */
-
-    /* Calculate the page class we are dealing with - Page multipliers */
-    *pageblock_size = 1 << (range_idx + PAGE_MULTIPLIER);                           /* Pageblock size = 2^(range_idx + PAGE_MULTIPLIER) */
-
-    /* Finalize */
-    return range_offset[range_idx] + subrange_idx;
-}
-
-/* Performs an allocation for a large object */
-static void *large_alloc(const size_t sz)
+/* Returns pageblock to the page allocator */
+static void ret_pageblock(const void *block, const size_t page_num)
 {
-    /* Find how many pages are needed - Header is included */
-    const size_t pages_num = GET_PAGE_NUM(sz + LARGE_HEADER_SIZE);
-
-    DEBUG_REAL_TOTAL_ALLOC(pages_num * PAGE_SZ);
+    const unsigned int page_class_idx = IDX_BY_PAGE_SZ(page_num);
+    const unsigned long int now = clock_ms();
 
-    /* Get needed pages - Large allocations directly to the kernel */
-    char *ret = (char *)mmap_wrap(pages_num);
+    pageblock_stamp((void *)block, page_num, now);
 
-    /* Success - Write the header and move to the payload */
-    if(ret)
+    /* 1st level of caching - Local thread cache, unless threads share the per-CPU caches (idle threads would hold them) */
+#ifdef PERCPU_CACHE_ACTIVE
+    if(percpu_caches || !stack_insert_bounded(&thread_data.top[page_class_idx], (page_t *) block, local_cache_depth))
+#else
+    if(!stack_insert_bounded(&thread_data.top[page_class_idx], (page_t *) block, local_cache_depth))
+#endif
     {
-        header_write_large(ret, pages_num);
-        ret += LARGE_HEADER_SIZE;
+        unsigned int shard;
+        numa_node_current(&shard);
+
+        /* 2nd level of caching - Global cache of its node, else it is retired in the arenas */
+        if(!global_cache_insert((void *)block, shard, page_class_idx))
+            arena_retire((void *)block, page_num);
     }
 
-    return ret;
+    purge_tick(now);
 }
 
-/* Performs a free for a large object */
-static void large_free(const void *obj)
+/* Maps a new arena of a node aligned at its size - Returns NULL in case of failure */
+static char *mmap_arena(const unsigned int node)
 {
-    /* Return the memory to the kernel */
-    munmap_wrap(GET_LARGER_ALLOC_START(obj), GET_LARGER_ALLOC_SZ(obj));
-}
+    /* Map twice the size, so that an aligned arena is in there */
+    char *block = (char *)mmap_wrap(2 * ARENA_PAGES);
+    if(!block) return NULL;
 
-/* Initializes a pageblock for the local heap */
-static page_t *page_internal_init(const void *alloc, const int object_class_idx, const int page_num, const unsigned int thread_id)
-{
-    /* Header starts from the initial mapped area - Common  */
-    page_t *page = (page_t *)alloc;
-    page->object_size = class_sizes[object_class_idx];
-    page->page_num = page_num;
-    page->allocated_objects = 0;
-    page->freed = 0;
-    page->sync.shared.thread_id = thread_id;
-    page->sync.shared.remotely_freed = 0;
-    page->sync.shared.count = 0;
-    page->next = page->prev = NULL;
+    char *arena = (char *)(((uintptr_t)block + ALIGN_MASK(ARENA_SZ)) & ~ALIGN_MASK(ARENA_SZ));
+    const size_t head_pages = (arena - block) >> PAGE_BITS;
 
-    /* The start of allocation space is after the header */
-    page->unallocated_off = sizeof(page_t);
+    /* Trim the excess around the aligned arena */
+    if(head_pages) munmap_wrap(block, head_pages);
+    munmap_wrap(arena + ARENA_SZ, ARENA_PAGES - head_pages);
 
-    /* Final step is to align the unallocated area at -1 8-byte aligned addresses */
-    uintptr_t align_rq = ALIGN_MASK(DEFAULT_ALLIGN);
-    align_rq -= ((uintptr_t) (((char *) page) + page->unallocated_off)) & align_rq;
+    /* Failure means no THP support - The arena is still usable with normal pages */
+    if(hugepage_mode) madvise(arena, ARENA_SZ, MADV_HUGEPAGE);
 
-//    /* TODO Opportunity for more alignment - Powers of 2 can be aligned even more */
-//    if(object_class_idx && IS_POWER_OF_TWO(class_sizes[object_class_idx - 1]))
-//    {
-//        /* The minimum of this class is the alignment request */
-//        align_rq = ALIGN_MASK(class_sizes[object_class_idx - 1]);
-//        alignment = ((uintptr_t) (((char *) page) + page->unallocated_off)) & align_rq;
-//        align_rq -= alignment;
-//    }
+#ifdef HEADERLESS_ACTIVE
+    /* Frees find the small objects through this - Arenas are never unmapped */
+    const uintptr_t slot = (uintptr_t)arena >> ARENA_BITS;
+    if(slot >= ARENA_SLOTS) PANIC_ERR("Arena out of the address space, aborting..[mmap_arena]\n");
 
-    /* Now we fix that by the amount of alignment */
-    page->unallocated_off += align_rq;
+    __atomic_fetch_or(&arena_slots[slot / (8 * sizeof(unsigned long int))], 1UL << (slot % (8 * sizeof(unsigned long int))), __ATOMIC_RELEASE);
+#endif
 
-    return page;
+    /* Pages are faulted in on the node - Preferred, so that a full node falls back to the others */
+    if(numa_nodes > 1)
+    {
+        const unsigned long int node_mask = 1UL << node;
+        syscall(SYS_mbind, arena, ARENA_SZ, MPOL_PREFERRED, &node_mask, 8 * sizeof(node_mask), 0);
+    }
+
+    return arena;
 }
 
-/* Tries to allocate an object from the page */
-static void *page_internal_alloc(page_t *page)
+/* Switches to a new arena of the node, if no one else did since old_bump was read - Returns 0 in case of failure */
+static int arena_grow(const unsigned int node, const uintptr_t old_bump)
 {
-    /* This function has 3 main paths of allocation:
-     * 1) A recently freed object, from the local LIFO (Fast path)
-     * 2) A never-allocated object from the unallocated area of the pageblock (Fast path)
-     * 3) A remotely freed object, from the remote LIFO (Slow path).
-     */
+    uintptr_t cur_bump, new_bump;
+    int ret = 1;
 
-    char *ret = NULL;
-    char *page_ptr = (char *)page;
+    spin_lock(&arena_lock[node]);
 
-    /* Collect any remotely freed objects */
-    if(page->sync.shared.remotely_freed)
+    /* Only the first thread that found the arena exhausted maps a new one */
+    cur_bump = arena_bump[node];
+
+    if((cur_bump & ~ALIGN_MASK(ARENA_SZ)) == (old_bump & ~ALIGN_MASK(ARENA_SZ)))
     {
-        rfid_un old_head, new_head;
+        char *arena = mmap_arena(node);
 
-        do
+        if(arena)
         {
-            /* Get old head */
-            old_head.both = page->sync.both;
+            /* Others can still bump the old arena until we switch - Its page map is in front of the pageblocks.
+             * Releases the setup of the arena (slot and NUMA policy) to whoever bumps it. */
+            new_bump = (uintptr_t) arena + ((SMALL_HEADER_SIZE) ? 0 : ARENA_MAP_PAGES);
+            while(!ATOMIC_CAS(&arena_bump[node], &new_bump, &cur_bump, __ATOMIC_RELEASE));
 
-            /* Zero out */
-            new_head.shared.thread_id = old_head.shared.thread_id;
-            new_head.shared.count = 0;
-            new_head.shared.remotely_freed = 0;
+            /* Whatever is left from the old arena goes to the caches */
+            if(cur_bump)
+            {
+                char *old_arena = (char *)(cur_bump & ~ALIGN_MASK(ARENA_SZ));
+                arena_scatter(node, old_arena + (cur_bump & ALIGN_MASK(ARENA_SZ)) * PAGE_SZ, old_arena + ARENA_SZ);
+            }
         }
-        while(!ATOMIC_CAS(&page->sync.both, &new_head.both, &old_head.both));
-
-        /* Insert in free LIFO */
-        while(old_head.shared.remotely_freed)
+        else
         {
-            /* Get object and keep next */
-            unsigned int *obj = (unsigned int *)(page_ptr + old_head.shared.remotely_freed);
-            unsigned int next = ((rfid_un *)obj)->shared.remotely_freed;
-
-            /* Push in local LIFO */
-            STACK_PUSH_OBJECT(page, obj, old_head.shared.remotely_freed);
-
-            /* Update cur */
-            old_head.shared.remotely_freed = next;
+            ret = 0;
         }
     }
 
-    /* First try - Check freed LIFO for available objects */
-    if(page->freed)
-    {
-        STACK_POP_OBJECT(page, ret);
-        return (void *)ret;
-    }
+    spin_unlock(&arena_lock[node]);
 
-    /* Second try - Check unallocated area for availability */
+    return ret;
+}
 
-    /* Find the base for the unallocated objects and the page limit */
-    char *base_alloc = page_ptr + page->unallocated_off;
-    const char *page_limit = page_ptr + (((unsigned int)page->page_num) * PAGE_SZ);
+/* Carves a pageblock out of the arenas of a node - Returns NULL in case of failure */
+static void *arena_alloc(const unsigned int node, const size_t page_num, unsigned int *zeroed_off)
+{
+    /* Pageblocks that were retired before */
+    void *block = NULL;
 
-    /* Check that we do not exceed allocation bounds */
-    if((base_alloc + page->object_size) < page_limit)
+    if(retired_heap[node][IDX_BY_PAGE_SZ(page_num)])
     {
-        /* Hold return value */
-        ret = base_alloc + sizeof(header_t);
-        
-        /* Form header */
-        header_write_small(page, ret);
-
-        /* Move the unallocated offset to the next object */
-        page->unallocated_off += page->object_size;
-        page->allocated_objects++;
-    }
+        void **retired = &retired_heap[node][IDX_BY_PAGE_SZ(page_num)];
 
-    return (void *)ret;
-}
-
-/* De-allocate an object inside a pageblock */
-static void page_internal_free(heap_t *local_heap, page_t *page, char *obj, const unsigned int thread_id)
-{
-    /* This function has 3 main paths:
-     * 1) Local free, then we simply insert in the local LIFO (simplest case).
-     * 2) Remote free where we insert in the remote LIFO, there are 2 paths:
-     *    => 2a) During the CAS operation we detect that the pageblock was orphaned,
-     *           we try to steal it and insert the pageblock in our pageblocks list (arry of classes).
-     *    => 2b) Else, leave it with the old value, of the other thread that owns the block.
-    */
+        spin_lock(&retired_lock);
 
-    /* Mainly to eliminate any typecasts below */
-    const unsigned int obj_offset = (unsigned int)((uintptr_t) (obj - ((char *) page)));
+        if((block = *retired))
+            *retired = *((void **)block);
 
-    if(page->sync.shared.thread_id == thread_id) /* Local case */
-    {
-        /* Push in local LIFO */
-        STACK_PUSH_OBJECT(page, (unsigned int *)obj, obj_offset);
+        spin_unlock(&retired_lock);
 
-        /* Check if the pageblock can be released back */
-        if(!page->allocated_objects && local_heap->head != page)
+        /* Everything after the first page was given back to the OS */
+        if(block)
         {
-            remove_node_dq(local_heap, page);
-            ret_pageblock((void *)page, page->page_num);
+            *zeroed_off = PAGE_SZ;
+            return block;
         }
     }
-    else /* Remote free, we do not own it */
+
+    /* Never touched memory of the arena - All zero */
+    *zeroed_off = 0;
+
+    /* Lock-free bump in the current arena */
+    while(1)
     {
-        rfid_un new_head;
-        rfid_un *obj_ptr = (rfid_un *) obj;
-        bool maybe_stolen;
+        uintptr_t old_bump = ATOMIC_LOAD(&arena_bump[node], __ATOMIC_ACQUIRE);
+        const uintptr_t used_pages = old_bump & ALIGN_MASK(ARENA_SZ);
 
-        do
+        /* Fits in the current arena */
+        if(old_bump && used_pages + page_num <= ARENA_PAGES)
         {
-            /* Old head values init */
-            obj_ptr->both = page->sync.both;
-            new_head.both = obj_ptr->both;
-            maybe_stolen = false;
+            uintptr_t new_bump = old_bump + page_num;
 
-            /* Steal case - Opportunistically try to also steal the pageblock in one go */
-            if(obj_ptr->shared.thread_id == ORPHAN_ID)
+            /* Nothing is published through the bump itself */
+            if(ATOMIC_CAS(&arena_bump[node], &new_bump, &old_bump, __ATOMIC_RELAXED))
             {
-                new_head.shared.thread_id = thread_id;
-                maybe_stolen = true;
+                /* The home node is kept in the header for as long as the pageblock exists */
+                block = (char *)(old_bump - used_pages) + used_pages * PAGE_SZ;
+                ((page_t *)block)->node = node;
+                arena_map_set((char *)block, page_num);
+                return block;
             }
 
-            /* Else update for insertion */
-            new_head.shared.remotely_freed = obj_offset;
-            new_head.shared.count += 1;
+            continue;
         }
-        while(!ATOMIC_CAS(&page->sync.both, &new_head.both, &obj_ptr->both));
 
-        /* Successful steal means insertion in our list */
-        if(maybe_stolen && page->sync.shared.thread_id == thread_id)
-        {
-            DEBUG_TOTAL_STEALS();
-            insert_front_dq(local_heap, page);
-        }
+        /* Exhausted or no arena yet */
+        if(!arena_grow(node, old_bump)) return NULL;
     }
 }
 
-/* Performs compile time checks - Asserts compiler error in case of failure */
-void compile_check_dummy(void)
+/* Splits the leftover of an arena into the largest pageblocks possible and caches them globally */
+static void arena_scatter(const unsigned int node, char *start, const char *end)
 {
-    /* CTC - Compile Time Check
-     * Mostly checks some assumptions that are more or less pretty common, but
-     * in any case we should have a safeguard. */
+    unsigned int shard;
+    numa_node_current(&shard);
 
-    /* Counting atomic list node - Compare and exchange for 64bits only */
-    CTC((sizeof(dq_ct_node) == 8));
-    CTC((sizeof(rfid) == 8));
+    for(int i = CLASS_PAGES_NUM - 1; i >= 0; i--)
+    {
+        const size_t block_sz = PAGE_SZ_BY_IDX(i) * PAGE_SZ;
+        dq_ct_node chain = {0};
 
-    /* Headers are 1-byte, else everything is doomed */
-    CTC((sizeof(header_t) == 1));
+        for(; (size_t)(end - start) >= block_sz; start += block_sz)
+        {
+            /* Never used - Nothing to purge */
+            ((page_t *)start)->zeroed_off = 0;
+            ((page_t *)start)->cached_time = 0;
+            ((page_t *)start)->node = node;
+            arena_map_set(start, PAGE_SZ_BY_IDX(i));
 
-    /* Minimum class is 7 effective bytes - So int offsets is all we have */
-    CTC((sizeof(int) == 4));
+            stack_insert(&chain, start);
+        }
 
-    /* Sometimes long int is used as an alias for pointers and compare and exchange */
+        /* Published at once */
+        global_cache_insert_chain(&chain, node, shard, i);
+    }
+}
+
+/* Retires a pageblock when all the caches are full - Memory goes back to the OS, the mapping stays */
+static void arena_retire(void *block, const size_t page_num)
+{
+    void **retired = &retired_heap[((page_t *)block)->node][IDX_BY_PAGE_SZ(page_num)];
+
+    /* The first page keeps the link (and the pageblock header) */
+    madvise(((char *)block) + PAGE_SZ, (page_num - 1) * PAGE_SZ, MADV_DONTNEED);
+
+    spin_lock(&retired_lock);
+
+    *((void **)block) = *retired;
+    *retired = block;
+
+    spin_unlock(&retired_lock);
+}
+
+/* Headerless mode - Records the distance of each page of a pageblock from its start, in the page map of the arena.
+ * Pageblocks keep their size for as long as the arena exists, so this is done once */
+static void arena_map_set(char *block, const size_t page_num)
+{
+#ifdef HEADERLESS_ACTIVE
+    unsigned char *map = (unsigned char *)((uintptr_t)block & ~ALIGN_MASK(ARENA_SZ));
+    const size_t first_page = ((uintptr_t)block & ALIGN_MASK(ARENA_SZ)) >> PAGE_BITS;
+
+    for(size_t i = 0; i < page_num; i++) map[first_page + i] = i;
+#endif
+}
+
+/* Coarse monotonic clock in ms - Served by the vDSO, good enough for decaying */
+static unsigned long int clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000UL;
+}
+
+/* Marks a pageblock that enters the caches - Its contents are dirty from now on */
+static void pageblock_stamp(void *block, const size_t page_num, const unsigned long int now)
+{
+    page_t *page = (page_t *)block;
+
+    page->zeroed_off = page_num * PAGE_SZ;
+    page->cached_time = now ? now : 1;
+
+    /* No decay - Straight back to the OS */
+    if(!purge_decay_ms) pageblock_purge(block, page_num);
+}
+
+/* Gives back to the OS everything but the first page of a cached pageblock - Returns 1 if memory was released */
+static int pageblock_purge(void *block, const size_t page_num)
+{
+    page_t *page = (page_t *)block;
+
+    /* Already purged or never used */
+    if(!page->cached_time) return 0;
+
+    page->cached_time = 0;
+
+#ifdef PURGE_LAZY
+    madvise(((char *)block) + PAGE_SZ, (page_num - 1) * PAGE_SZ, MADV_FREE);
+#else
+    madvise(((char *)block) + PAGE_SZ, (page_num - 1) * PAGE_SZ, MADV_DONTNEED);
+
+    /* Comes back zeroed */
+    page->zeroed_off = PAGE_SZ;
+#endif
+
+    return 1;
+}
+
+/* Purges the pageblocks of a cache that were cached before the cutoff - Returns 1 if memory was released.
+ * The pageblocks are taken out and put back in the same order, shared caches are never locked: they are emptied
+ * and refilled with a single swap each. */
+static int cache_purge(dq_ct_node *stack, const size_t page_num, const unsigned long int cutoff, const int shared)
+{
+    dq_ct_node taken = *stack;
+    dq_ct_node kept = {0};
+    page_t *block;
+    int ret = 0;
+
+    if(shared) stack_remove_all_atomic(stack, &taken);
+
+    while((block = stack_remove(&taken)))
+    {
+        if(block->cached_time && block->cached_time <= cutoff)
+            ret |= pageblock_purge(block, page_num);
+
+        stack_insert(&kept, block);
+    }
+
+    while((block = stack_remove(&kept))) stack_insert(&taken, block);
+
+    /* Local ones always fit back, shared ones might have been refilled meanwhile - Up to their depth, the rest is retired */
+    if(!shared) *stack = taken;
+    else if(!stack_insert_chain_atomic(stack, &taken, global_cache_depth))
+    {
+        while((block = stack_remove(&taken)))
+            if(!stack_insert_atomic_bounded(stack, block, global_cache_depth)) arena_retire(block, page_num);
+    }
+
+    return ret;
+}
+
+/* Purges decayed pageblocks - Rate limited to PURGE_TICKS passes per decay period, locally and globally */
+static void purge_tick(const unsigned long int now)
+{
+    if(purge_decay_ms <= 0) return;
+
+    const unsigned long int interval = (purge_decay_ms + PURGE_TICKS - 1) / PURGE_TICKS;
+    const unsigned long int cutoff = (now > (unsigned long int)purge_decay_ms) ? now - purge_decay_ms : 0;
+
+    /* Local caches first */
+    if(now - thread_data.purge_last < interval) return;
+
+    thread_data.purge_last = now;
+
+    for(int i = 0; i < CLASS_PAGES_NUM; i++)
+        cache_purge(&thread_data.top[i], PAGE_SZ_BY_IDX(i), cutoff, 0);
+
+    /* Global caches - A single thread does it, the rest move on */
+    if(now - purge_last < interval || !spin_trylock(&purge_lock)) return;
+
+    if(now - purge_last >= interval)
+    {
+        for(unsigned int n = 0; n < numa_nodes; n++)
+        for(int i = 0; i < CLASS_PAGES_NUM; i++)
+        for(int j = 0; j < GLOBAL_SHARDS; j++)
+            cache_purge(&global_freeheap[n][i][j].top, PAGE_SZ_BY_IDX(i), cutoff, 1);
+
+        purge_last = now;
+    }
+
+    spin_unlock(&purge_lock);
+}
+
+/* Reads the run-time configuration - Called once when the library is loaded */
+static void __attribute__((constructor)) allocator_init(void)
+{
+    const char *env = getenv("XMALLOC_HUGEPAGES");
+
+    /* Pageblocks are carved and unmapped at our page size - aarch64 kernels can run with 16KB or 64KB pages */
+    if(sysconf(_SC_PAGESIZE) != PAGE_SZ) PANIC_ERR("The page size of the system is not 4KB, aborting..\n");
+
+    if(env) hugepage_mode = (atoi(env) != 0);
+
+    if((env = getenv("XMALLOC_DECAY_MS"))) purge_decay_ms = atol(env);
+
+    if((env = getenv("XMALLOC_PROF_SAMPLE"))) prof_interval = (atol(env) > 0) ? atol(env) : 0;
+
+    /* NUMA awareness only makes sense with more than one node */
+    if(!(env = getenv("XMALLOC_NUMA")) || atoi(env)) numa_nodes = numa_nodes_detect();
+
+    conf_load();
+
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+/* Reads XMALLOC_CONF once - Whoever comes first, the first thread or the constructor */
+static void conf_load(void)
+{
+    const char *env;
+
+    if(conf_loaded || ATOMIC_EXCHANGE(&conf_loaded, 1, __ATOMIC_ACQ_REL)) return;
+
+    if((env = getenv("XMALLOC_CONF"))) conf_parse(env);
+
+#ifdef PERCPU_CACHE_ACTIVE
+    percpu_init();
+#endif
+}
+
+/* Before fork - Every global lock is taken, so that the child does not inherit one held by a thread it does not have */
+static void fork_prepare(void)
+{
+    /* A child forking again - The threads it did not inherit are reclaimed first, not copied twice */
+    fork_reclaim();
+
+    /* Nesting order - None of them is ever taken while holding one that comes later */
+    spin_lock(&fork_lock);
+    spin_lock(&registry_lock);
+    spin_lock(&recycled_ids_lock);
+    spin_lock(&prof_lock);
+    spin_lock(&purge_lock);
+
+    for(int i = 0; i < CLASS_NUM; i++)
+        spin_lock(&orphan_lock[i]);
+
+    for(int i = 0; i < LARGE_CLASS_NUM; i++)
+        spin_lock(&global_large_lock[i]);
+
+    for(int i = 0; i < NUMA_NODES_MAX; i++)
+        spin_lock(&arena_lock[i]);
+
+    spin_lock(&retired_lock);
+}
+
+/* After fork in the parent - Releases the locks in reverse order */
+static void fork_parent(void)
+{
+    spin_unlock(&retired_lock);
+
+    for(int i = NUMA_NODES_MAX - 1; i >= 0; i--)
+        spin_unlock(&arena_lock[i]);
+
+    for(int i = LARGE_CLASS_NUM - 1; i >= 0; i--)
+        spin_unlock(&global_large_lock[i]);
+
+    for(int i = CLASS_NUM - 1; i >= 0; i--)
+        spin_unlock(&orphan_lock[i]);
+
+    spin_unlock(&purge_lock);
+    spin_unlock(&prof_lock);
+    spin_unlock(&recycled_ids_lock);
+    spin_unlock(&registry_lock);
+    spin_unlock(&fork_lock);
+}
+
+/* After fork in the child - Only the forking thread made it here. The rest leave the registry and are copied out of
+ * their TLS, which new threads can get again, in a single mapping of sizeof(thread_private_t) per thread. Their heaps,
+ * and the parked pageblocks of ours, are left to our next slow path. Children that exec pay only for the copies. */
+static void fork_child(void)
+{
+    thread_private_t *stale = NULL, *copies;
+    size_t stale_num = 0;
+
+    /* The locks are ours - Released like the parent does */
+    fork_parent();
+
+    /* Constructed now if we never allocated before */
+    thread_private_t *const self = &thread_data;
+
+    spin_lock(&registry_lock);
+
+    for(thread_private_t *cur = thread_registry; cur; cur = cur->reg_next)
+        stale_num += (cur != self);
+
+    if(stale_num)
+    {
+        fork_copies_pages = GET_PAGE_NUM(stale_num * sizeof(thread_private_t));
+        fork_copies = copies = (thread_private_t *)mmap_wrap(fork_copies_pages);
+
+        /* Without the copies their heaps are leaked - They still cannot stay in the registry. So are the ones caught
+         * in a slow path or exiting, their lists can be halfway through an update or already given back. */
+        for(thread_private_t *cur = thread_registry; cur && copies; cur = cur->reg_next)
+        {
+            if(cur == self || cur->busy || cur->releasing) continue;
+
+            memcpy((void *)copies, cur, sizeof(thread_private_t));
+            copies->reg_next = stale;
+            stale = copies++;
+        }
+
+        self->reg_prev = self->reg_next = NULL;
+        thread_registry = self;
+    }
+
+    spin_unlock(&registry_lock);
+
+    /* Published last - Even if all of them were skipped, remote frees of theirs may be stuck notifying us */
+    if(stale_num)
+    {
+        thread_private_t *forker = self;
+
+        fork_stale = stale;
+        ATOMIC_STORE(&fork_self, &forker, __ATOMIC_RELEASE);
+    }
+}
+
+/* Settles the parked pageblocks a remote free was notifying about at the fork - The thread doing it is not in the child,
+ * so nobody would finish it. Whether it got in the notification stack or not, it stays in the full list until collected
+ * or released, both of which wait for NOTIFYING to end. Called before both, new remote frees can still race us. */
+static void fork_settle(heap_t *local_heaps)
+{
+    rfid_un old_head, new_head;
+
+    for(int i = 0; i < CLASS_NUM; i++)
+    for(page_t *cur = local_heaps[i].full.head; cur; cur = cur->next)
+    {
+        do
+        {
+            old_head.both = cur->sync.both;
+            if(old_head.shared.state != PAGE_STATE_NOTIFYING) break;
+
+            new_head = old_head;
+            new_head.shared.state = PAGE_STATE_NONE;
+        }
+        while(!ATOMIC_CAS(&cur->sync.both, &new_head.both, &old_head.both, __ATOMIC_RELAXED));
+    }
+}
+
+/* Releases the heaps of the threads a forked child did not inherit - Returns 1 if there were some */
+static int fork_reclaim(void)
+{
+    thread_private_t *none = NULL;
+
+    /* Racy check - Only children of multithreaded parents find them, until the first of their slow paths */
+    if(!ATOMIC_LOAD(&fork_self, __ATOMIC_ACQUIRE)) return 0;
+
+    spin_lock(&fork_lock);
+
+    /* The forking thread waits for us on the lock in its slow paths - Its full lists hold still */
+    if(fork_self) fork_settle(fork_self->private_heap);
+
+    for(thread_private_t *cur = fork_stale, *next; cur; cur = next)
+    {
+        next = cur->reg_next;
+
+        /* Before the release waits for it */
+        fork_settle(cur->private_heap);
+
+        /* Registered again - It leaves as any exited thread, its statistics go to the exited totals */
+        spin_lock(&registry_lock);
+
+        cur->reg_prev = NULL;
+        cur->reg_next = thread_registry;
+        if(thread_registry) thread_registry->reg_prev = cur;
+        thread_registry = cur;
+
+        spin_unlock(&registry_lock);
+
+        cur->release();
+    }
+
+    if(fork_copies) munmap_wrap(fork_copies, fork_copies_pages);
+    fork_copies = NULL;
+    fork_stale = NULL;
+
+    /* Cleared last - Whoever found them waited for us on the lock */
+    ATOMIC_STORE(&fork_self, &none, __ATOMIC_RELEASE);
+
+    spin_unlock(&fork_lock);
+
+    return 1;
+}
+
+/* Matches an option name of XMALLOC_CONF */
+#define CONF_IS(key, key_len, name)     ((key_len) == sizeof(name) - 1 && !strncmp((key), (name), (key_len)))
+
+/* Parses XMALLOC_CONF - Comma separated "option:value" pairs. Bad pairs are reported and skipped */
+static void conf_parse(const char *conf)
+{
+    /* The layout of the pageblocks cannot change under carved ones - Large allocations do not mind */
+    int layout_fixed = 0;
+
+    for(int i = 0; i < NUMA_NODES_MAX; i++) layout_fixed |= (arena_bump[i] != 0);
+
+    while(*conf)
+    {
+        const char *sep = strchr(conf, ':');
+        const char *next = strchr(conf, ',');
+        const size_t key_len = sep ? sep - conf : 0;
+        char *end = NULL;
+        long int val = -1;
+
+        if(!next) next = conf + strlen(conf);
+        if(sep && sep < next) val = strtol(sep + 1, &end, 10);
+
+        /* Value has to be the whole of the pair */
+        if(!end || end != next || end == sep + 1) val = -1;
+
+        if(CONF_IS(conf, key_len, "small_limit") && val >= DEFAULT_ALLIGN && val <= SMALL_ALLOCATION_LIMIT && !layout_fixed)
+            conf_small_limit(val);
+        else if(CONF_IS(conf, key_len, "pageblock_multiplier") && val >= 0 && val <= PAGE_MULTIPLIER && !layout_fixed)
+            page_multiplier = val;
+        else if(CONF_IS(conf, key_len, "tcache_depth") && val >= 2 && val <= TCACHE_DEPTH)
+            tcache_depth = val;
+        else if(CONF_IS(conf, key_len, "empty_pageblocks") && val >= 0 && val <= 1024)
+            empty_pageblocks = val;
+        else if(CONF_IS(conf, key_len, "global_cache_depth") && val >= 0 && (unsigned long int)val <= COUNT_MAX)
+            global_cache_depth = val;
+        else if(CONF_IS(conf, key_len, "local_cache_depth") && val >= 0 && (unsigned long int)val <= COUNT_MAX)
+            local_cache_depth = val;
+        else if(CONF_IS(conf, key_len, "large_local_cache") && val >= 0)
+            large_local_cache = val;
+        else if(CONF_IS(conf, key_len, "large_global_cache") && val >= 0)
+            large_global_cache = val;
+        else
+        {
+            int ret = write(2, "xmalloc: ignoring XMALLOC_CONF option ", 38);
+            ret += write(2, conf, next - conf);
+            ret += write(2, "\n", 1);
+        }
+
+        conf = *next ? next + 1 : next;
+    }
+}
+
+/* Requests below the limit are small - Rounded to the end of the class that holds limit - 1 bytes,
+ * so that every request of the classes above it is large */
+static void conf_small_limit(const size_t limit)
+{
+    int page_num;
+    const int last_class = class_size_decode(SMALL_CLASS_REQUEST(limit - 1), &page_num);
+    const size_t class_limit = class_sizes[last_class] - SMALL_HEADER_SIZE + 1;
+
+    small_classes = last_class + 1;
+    small_limit = (class_limit < SMALL_ALLOCATION_LIMIT) ? class_limit : SMALL_ALLOCATION_LIMIT;
+}
+
+/* Finds how many NUMA nodes or CPUs the machine may have from their sysfs list - Raw reads, stdio allocates.
+ * Returns 0 if the list cannot be read */
+static unsigned int possible_detect(const char *path)
+{
+    char buf[64];
+    unsigned int last = 0;
+    int fd = open(path, O_RDONLY);
+
+    if(fd < 0) return 0;
+
+    const ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if(len <= 0) return 0;
+
+    /* Lists like "0-3,5" - The last entry is the largest one */
+    for(ssize_t i = 0; i < len; i++)
+    {
+        if(buf[i] >= '0' && buf[i] <= '9') last = last * 10 + (buf[i] - '0');
+        else if(buf[i] == '-' || buf[i] == ',') last = 0;
+    }
+
+    return last + 1;
+}
+
+/* Finds how many NUMA nodes the machine may have */
+static unsigned int numa_nodes_detect(void)
+{
+    const unsigned int nodes = possible_detect("/sys/devices/system/node/possible");
+
+    if(!nodes) return 1;
+
+    return (nodes < NUMA_NODES_MAX) ? nodes : NUMA_NODES_MAX;
+}
+
+/* NUMA node the calling thread runs on and the global cache shard of its CPU - Served by the vDSO,
+ * threads can migrate so neither is cached */
+static unsigned int numa_node_current(unsigned int *shard)
+{
+    unsigned int cpu, node;
+
+    if(getcpu(&cpu, &node))
+    {
+        *shard = 0;
+        return 0;
+    }
+
+    *shard = cpu % GLOBAL_SHARDS;
+
+    return (node < numa_nodes) ? node : 0;
+}
+
+/* Removes a pageblock from the global cache of a node - Returns NULL if all of its shards are empty */
+static page_t *global_cache_remove(const unsigned int node, const unsigned int shard, const int page_class_idx)
+{
+    page_t *block = NULL;
+
+    for(unsigned int i = 0; !block && i < GLOBAL_SHARDS; i++)
+        block = stack_remove_atomic(&global_freeheap[node][page_class_idx][(shard + i) % GLOBAL_SHARDS].top);
+
+    return block;
+}
+
+/* Inserts a pageblock in the global cache of its node - Returns 0 if all of its shards are full */
+static int global_cache_insert(void *block, const unsigned int shard, const int page_class_idx)
+{
+    global_shard_t *shards = global_freeheap[((page_t *)block)->node][page_class_idx];
+
+    for(unsigned int i = 0; i < GLOBAL_SHARDS; i++)
+        if(stack_insert_atomic_bounded(&shards[(shard + i) % GLOBAL_SHARDS].top, block, global_cache_depth)) return 1;
+
+    return 0;
+}
+
+/* Inserts a chain of pageblocks of a node in its global cache - In a single swap when a shard has room for all of them,
+ * else one by one, and what does not fit is retired */
+static void global_cache_insert_chain(dq_ct_node *chain, const unsigned int node, const unsigned int shard, const int page_class_idx)
+{
+    global_shard_t *shards = global_freeheap[node][page_class_idx];
+    page_t *block;
+
+    for(unsigned int i = 0; i < GLOBAL_SHARDS; i++)
+        if(stack_insert_chain_atomic(&shards[(shard + i) % GLOBAL_SHARDS].top, chain, global_cache_depth)) return;
+
+    while((block = stack_remove(chain)))
+        if(!global_cache_insert(block, shard, page_class_idx)) arena_retire(block, PAGE_SZ_BY_IDX(page_class_idx));
+}
+
+#ifndef HEADERLESS_ACTIVE
+/* Forms the header for a small allocation */
+static void header_write_small(const page_t *page, char *obj)
+{
+    /* Form the header */
+    header_t header = HEADER_SMALL | HEADER_VALID;
+
+    /* How many pages separate us from the start of the page */
+    const int page_offset = ((uintptr_t) ((obj - (char *)page))) >> PAGE_BITS;
+
+    /* Set the page offset value */
+    header |= HEADER_PAGE_OFFSET_SET(page_offset);
+
+    /* Write the header */
+    WRITE_HEADER(obj - sizeof(header_t), &header);
+}
+#endif
+
+/* Forms the header for a large allocation. Assumes large allocations are page aligned. */
+static void header_write_large(char *obj, const size_t sz)
+{
+    /* Form the header */
+    const header_t header = HEADER_LARGE | HEADER_VALID;
+
+    /* Write the large alloc size and the common header - Not sampled */
+    WRITE_LARGE_HEADER_SZ((size_t *)obj, &sz);
+    LARGE_SAMPLED(obj + LARGE_HEADER_SIZE) = 0;
+    WRITE_HEADER(obj + LARGE_HEADER_SIZE - sizeof(header_t), &header);
+}
+
+/* Decodes the type of object and checks if any corruption happened */
+static int object_type_decode(const void *obj, int *page_offset)
+{
+    const header_t header = GET_HEADER(obj);
+
+    /* Write out the page offset - In case of large allocation this is ignored */
+    *page_offset = HEADER_PAGE_OFFSET_GET(header);
+
+    /* Check validity */
+    return HEADER_IS_BLOCK_VALID(header) ? HEADER_PAGE_GET_TYPE(header) : -1;
+}
+
+/* Decodes the type of object and finds the pageblock of small ones - Returns -1 in case of corruption */
+static inline int object_page_decode(const void *obj, page_t **page)
+{
+    int page_offset;
+
+#ifdef HEADERLESS_ACTIVE
+    const uintptr_t slot = (uintptr_t)obj >> ARENA_BITS;
+
+    /* Not in an arena - Large allocations still have their header */
+    if(slot >= ARENA_SLOTS || !(arena_slots[slot / (8 * sizeof(unsigned long int))] & (1UL << (slot % (8 * sizeof(unsigned long int))))))
+    {
+        *page = NULL;
+        return (object_type_decode(obj, &page_offset) == CLASS_LARGE) ? CLASS_LARGE : -1;
+    }
+
+    const unsigned char *map = (const unsigned char *)((uintptr_t)obj & ~ALIGN_MASK(ARENA_SZ));
+    page_offset = map[((uintptr_t)obj & ALIGN_MASK(ARENA_SZ)) >> PAGE_BITS];
+
+    *page = GET_PAGE_START(obj, page_offset);
+    return CLASS_SMALL;
+#else
+    const int type = object_type_decode(obj, &page_offset);
+
+    *page = GET_PAGE_START(obj, page_offset);
+    return type;
+#endif
+}
+
+/* Finds the real class size and returns index to it */
+static int class_size_decode(const size_t size, int *pageblock_size)
+{
+    /* The size is the request minus one - Rounded up to the 16 bytes of an entry */
+    const unsigned int entry = class_lut.entries[(size + 16) >> 4];
+
+    /* Pageblock size = 2^(range_idx + page_multiplier) */
+    *pageblock_size = 1 << ((entry >> CLASS_LUT_RANGE_SHIFT) + page_multiplier);
+
+    return entry & ALIGN_MASK(1 << CLASS_LUT_RANGE_SHIFT);
+}
+
+/* Finds the large bin of an allocation and the pages each allocation in it has */
+static int large_class_decode(const size_t page_num, size_t *bin_page_num)
+{
+    /* Exact bins up to 8 pages */
+    if(page_num <= 8)
+    {
+        *bin_page_num = page_num;
+        return page_num - 1;
+    }
+
+    /* Then 4 bins for every power of two - The range (2^e, 2^(e+1)] is split by 2^(e-2) */
+    const unsigned int range_idx = LOG2(page_num - 1);
+    const int bin_idx = 8 + ((range_idx - 3) << 2) + ((page_num - 1) >> (range_idx - 2)) - 4;
+
+    *bin_page_num = LARGE_PAGES_BY_IDX(bin_idx);
+
+    return bin_idx;
+}
+
+/* Releases a large allocation in the global bins, or to the OS when they are over their budget */
+static void large_global_release(void *block, const int bin_idx)
+{
+    const size_t bin_page_num = LARGE_PAGES_BY_IDX(bin_idx);
+    const size_t bytes = bin_page_num * PAGE_SZ;
+    int ret = 0;
+
+    /* Reserved first - The bins have locks of their own */
+    if(ATOMIC_ADD(&global_large_cached, bytes, __ATOMIC_RELAXED) <= large_global_cache)
+    {
+        spin_lock(&global_large_lock[bin_idx]);
+        ret = stack_insert(&global_large_freeheap[bin_idx], block);
+        spin_unlock(&global_large_lock[bin_idx]);
+    }
+
+    if(!ret)
+    {
+        ATOMIC_ADD(&global_large_cached, -bytes, __ATOMIC_RELAXED);
+        munmap_wrap(block, bin_page_num);
+    }
+}
+
+/* Performs an allocation for a large object - Zeroed on request, fresh mappings are already zero */
+static void *large_alloc(const size_t sz, const int zero)
+{
+    const thread_busy_t busy;
+
+    /* Find how many pages are needed - Header is included */
+    size_t pages_num = GET_PAGE_NUM(sz + LARGE_HEADER_SIZE);
+    char *ret = NULL;
+
+    /* Binned allocations - Thread cache, global cache and then the kernel */
+    if(pages_num <= LARGE_CACHE_MAX_PAGES)
+    {
+        const int bin_idx = large_class_decode(pages_num, &pages_num);
+
+        /* 1st level - Local thread cache */
+        if((ret = (char *)stack_remove(&thread_data.large_top[bin_idx])))
+            thread_data.large_cached -= pages_num * PAGE_SZ;
+
+        /* 2nd level - Global cache */
+        else if(!stack_is_empty(&global_large_freeheap[bin_idx]))
+        {
+            spin_lock(&global_large_lock[bin_idx]);
+            ret = (char *)stack_remove(&global_large_freeheap[bin_idx]);
+            spin_unlock(&global_large_lock[bin_idx]);
+
+            if(ret) ATOMIC_ADD(&global_large_cached, -(pages_num * PAGE_SZ), __ATOMIC_RELAXED);
+        }
+    }
+
+    DEBUG_REAL_TOTAL_ALLOC(pages_num * PAGE_SZ);
+
+    /* Cached blocks hold old data */
+    if(ret)
+    {
+        if(zero) memset(ret + LARGE_HEADER_SIZE, 0, sz);
+    }
+    /* Get needed pages - Huge allocations directly to the kernel */
+    else ret = (char *)mmap_wrap(pages_num);
+
+    /* Success - Write the header and move to the payload */
+    if(ret)
+    {
+        header_write_large(ret, pages_num);
+        ret += LARGE_HEADER_SIZE;
+
+        thread_data.large_stats.allocs++;
+        thread_data.large_stats.pages += pages_num;
+    }
+
+    return ret;
+}
+
+/* Performs a free for a large object */
+static void large_free(const void *obj)
+{
+    const thread_busy_t busy;
+    void *block = GET_LARGER_ALLOC_START(obj);
+    const size_t pages_num = GET_LARGER_ALLOC_SZ(obj);
+    size_t bin_page_num = 0;
+    int bin_idx = (pages_num <= LARGE_CACHE_MAX_PAGES) ? large_class_decode(pages_num, &bin_page_num) : -1;
+
+    if(LARGE_SAMPLED(obj)) prof_remove(obj);
+
+    thread_data.large_stats.frees++;
+    thread_data.large_stats.pages -= pages_num;
+
+    /* Not of a bin size - Return the memory to the kernel */
+    if(bin_page_num != pages_num)
+    {
+        munmap_wrap(block, pages_num);
+        return;
+    }
+
+    /* 1st level of caching - Local thread cache within its budget, else the global cache */
+    if(thread_data.large_cached + bin_page_num * PAGE_SZ <= large_local_cache && stack_insert(&thread_data.large_top[bin_idx], block))
+        thread_data.large_cached += bin_page_num * PAGE_SZ;
+    else
+        large_global_release(block, bin_idx);
+}
+
+/* Resizes a large object that stays large - Returns NULL in case of failure, the object is then untouched */
+static void *large_realloc(void *obj, const size_t sz)
+{
+    char *block = (char *)GET_LARGER_ALLOC_START(obj);
+    const size_t pages_num = GET_LARGER_ALLOC_SZ(obj);
+    const size_t payload_off = (char *)obj - block;
+    const char sampled = LARGE_SAMPLED(obj);
+    size_t new_pages_num = GET_PAGE_NUM(sz + payload_off);
+
+    /* Binned sizes are kept at the bin size, so they are still cached when freed */
+    if(new_pages_num <= LARGE_CACHE_MAX_PAGES) large_class_decode(new_pages_num, &new_pages_num);
+
+    if(new_pages_num < pages_num) /* Shrink - Release the tail pages */
+    {
+        munmap_wrap(block + new_pages_num * PAGE_SZ, pages_num - new_pages_num);
+    }
+    else if(new_pages_num > pages_num) /* Grow - The kernel extends in place if it can, else moves the pages */
+    {
+        block = (char *)mremap_wrap(block, pages_num, new_pages_num);
+        if(!block) return NULL;
+    }
+
+    /* Update the size - The payload stays where it was in the block */
+    header_write_large(block + payload_off - LARGE_HEADER_SIZE, new_pages_num);
+    thread_data.large_stats.pages += (long int)new_pages_num - (long int)pages_num;
+
+    /* The sample follows the object */
+    if(sampled)
+    {
+        LARGE_SAMPLED(block + payload_off) = 1;
+        prof_move(obj, block + payload_off, sz);
+    }
+
+    return block + payload_off;
+}
+
+/* Performs a large allocation with its payload aligned at a page or more - The payload starts on the second page
+ * of the block, so that the header fits at the end of the first one. Up to a page this is a normal (binned) large
+ * allocation, above that the mapping is trimmed around the alignment. */
+static void *large_aligned_alloc(const size_t sz, const size_t alignment)
+{
+    size_t pages_num = GET_PAGE_NUM(sz) + 1;
+    char *block;
+
+    if(alignment <= PAGE_SZ)
+    {
+        block = (char *)large_alloc(pages_num * PAGE_SZ - LARGE_HEADER_SIZE, 0);
+        if(!block) return NULL;
+
+        /* Move the header in front of the second page */
+        block -= LARGE_HEADER_SIZE;
+        pages_num = GET_LARGER_ALLOC_SZ(block + LARGE_HEADER_SIZE);
+    }
+    else
+    {
+        const size_t extra_pages = (alignment >> PAGE_BITS) - 1;
+        char *map = (char *)mmap_wrap(pages_num + extra_pages);
+        if(!map) return NULL;
+
+        /* Release the pages around the aligned block */
+        block = (char *)(((uintptr_t)map + PAGE_SZ + ALIGN_MASK(alignment)) & ~ALIGN_MASK(alignment)) - PAGE_SZ;
+        const size_t front_pages = (block - map) >> PAGE_BITS;
+
+        if(front_pages) munmap_wrap(map, front_pages);
+        if(extra_pages - front_pages) munmap_wrap(block + pages_num * PAGE_SZ, extra_pages - front_pages);
+
+        thread_data.large_stats.allocs++;
+        thread_data.large_stats.pages += pages_num;
+    }
+
+    header_write_large(block + PAGE_SZ - LARGE_HEADER_SIZE, pages_num);
+
+    return block + PAGE_SZ;
+}
+
+/* Usable bytes of a large object - Up to the end of its block */
+static size_t large_usable_size(const void *obj)
+{
+    const char *block = (const char *)GET_LARGER_ALLOC_START(obj);
+
+    return block + GET_LARGER_ALLOC_SZ(obj) * PAGE_SZ - (const char *)obj;
+}
+
+/* Offset of the first object of a pageblock - After the header and the bitmap of the double free checks */
+static unsigned int page_objects_off(const int page_num, const unsigned int object_size)
+{
+    const uintptr_t off = sizeof(page_t) + FREE_MAP_SIZE(page_num);
+
+    /* Final step is to align the unallocated area, so that the objects after their header are aligned - All objects are then aligned at the largest
+     * power of 2 that divides the class size (at least 16 bytes). Powers of 2 are aligned at their size and multiples
+     * of a cache line at the line, aligned and line aligned allocations are served from these classes.
+     * The page header already takes the space of the padding, so this costs no objects in the classes of 128 bytes or more.
+     * Pageblocks are page aligned, so the offset alone tells the padding */
+    const uintptr_t align_mask = ALIGN_MASK(LOWEST_POWER_OF_TWO(object_size));
+    const uintptr_t align_rq = (align_mask + 1 - ((off + SMALL_HEADER_SIZE) & align_mask)) & align_mask;
+
+    return off + align_rq;
+}
+
+/* Initializes a pageblock for the local heap */
+static page_t *page_internal_init(const void *alloc, const int object_class_idx, const int page_num, const unsigned int zeroed_off, const unsigned int thread_id, page_t *volatile *notify)
+{
+    /* Header starts from the initial mapped area - Common  */
+    page_t *page = (page_t *)alloc;
+    page->object_size = class_sizes[object_class_idx];
+    page->class_idx = object_class_idx;
+    page->page_num = page_num;
+    page->allocated_objects = 0;
+    page->freed = 0;
+    page->parked = 0;
+    page->pooled = 0;
+    page->zeroed_off = zeroed_off;
+    page->notify_next = NULL;
+    page->notify = notify;
+    page->sync.shared.thread_id = thread_id;
+    page->sync.shared.state = PAGE_STATE_NONE;
+    page->sync.shared.remotely_freed = 0;
+    page->sync.shared.count = 0;
+    page->next = page->prev = NULL;
+
+    /* Objects start after the header and the bitmap of the double free checks */
+    page->unallocated_off = page_objects_off(page_num, page->object_size);
+
+#ifdef FREE_CHECK_ACTIVE
+    memset(FREE_MAP(page), 0, FREE_MAP_SIZE(page_num));
+#endif
+
+    return page;
+}
+
+/* Tries to allocate an object from the page */
+static void *page_internal_alloc(page_t *page)
+{
+    /* This function has 3 main paths of allocation:
+     * 1) A recently freed object, from the local LIFO (Fast path)
+     * 2) A never-allocated object from the unallocated area of the pageblock (Fast path)
+     * 3) A remotely freed object, from the remote LIFO (Slow path).
+     */
+
+    char *ret = NULL;
+    char *page_ptr = (char *)page;
+
+    /* Collect any remotely freed objects */
+    if(page->sync.shared.remotely_freed)
+    {
+        rfid_un old_head, new_head;
+
+        do
+        {
+            /* Get old head */
+            old_head.both = page->sync.both;
+
+            /* Zero out - Keep the ID and the state */
+            new_head = old_head;
+            new_head.shared.count = 0;
+            new_head.shared.remotely_freed = 0;
+        }
+        while(!ATOMIC_CAS(&page->sync.both, &new_head.both, &old_head.both, __ATOMIC_ACQUIRE));
+
+        /* Insert in free LIFO */
+        while(old_head.shared.remotely_freed)
+        {
+            /* Get object and keep next */
+            unsigned int *obj = (unsigned int *)(page_ptr + old_head.shared.remotely_freed);
+            unsigned int next = ((rfid_un *)obj)->shared.remotely_freed;
+
+            /* Push in local LIFO */
+            STACK_PUSH_OBJECT(page, obj, old_head.shared.remotely_freed);
+
+            /* Update cur */
+            old_head.shared.remotely_freed = next;
+        }
+    }
+
+    /* First try - Check freed LIFO for available objects */
+    if(page->freed)
+    {
+        STACK_POP_OBJECT(page, ret);
+
+        /* The new head is handed out next and its link read - Written by the caller, most likely. Without one, the
+         * allocations move to the next pageblock of the list if the unallocated area is exhausted too */
+        if(page->freed) __builtin_prefetch(page_ptr + page->freed, 1);
+        else if(page->unallocated_off + page->object_size > ((unsigned int)page->page_num) * PAGE_SZ) __builtin_prefetch(page->next);
+
+        return (void *)ret;
+    }
+
+    /* Second try - Check unallocated area for availability */
+    return page_internal_bump(page);
+}
+
+/* Allocates a never-allocated object from the unallocated area of the pageblock */
+static void *page_internal_bump(page_t *page)
+{
+    char *ret = NULL;
+    char *page_ptr = (char *)page;
+
+    /* Find the base for the unallocated objects and the page limit */
+    char *base_alloc = page_ptr + page->unallocated_off;
+    const char *page_limit = page_ptr + (((unsigned int)page->page_num) * PAGE_SZ);
+
+    /* Check that we do not exceed allocation bounds */
+    if((base_alloc + page->object_size) <= page_limit)
+    {
+        /* Hold return value */
+        ret = base_alloc + SMALL_HEADER_SIZE;
+
+#ifndef HEADERLESS_ACTIVE
+        /* Form header */
+        header_write_small(page, ret);
+#endif
+
+        /* Move the unallocated offset to the next object */
+        page->unallocated_off += page->object_size;
+        page->allocated_objects++;
+
+        /* Last one - The next pageblock of the list is where the allocations move to */
+        if(base_alloc + 2 * page->object_size > page_limit) __builtin_prefetch(page->next);
+    }
+
+    return (void *)ret;
+}
+
+/* De-allocate an object inside a pageblock */
+static void page_internal_free(thread_private_t *local_data, page_t *page, char *obj)
+{
+    /* This function has 3 main paths:
+     * 1) Local free, then we simply insert in the local LIFO (simplest case).
+     * 2) Remote free where we insert in the remote LIFO, there are 2 paths:
+     *    => 2a) During the CAS operation we detect that the pageblock was orphaned,
+     *           we try to steal it and insert the pageblock in our pageblocks list (arry of classes).
+     *    => 2b) Else, leave it with the old value, of the other thread that owns the block.
+     *           If the owner parked the pageblock in its full list, we are the ones that notify it.
+    */
+
+    /* Mainly to eliminate any typecasts below */
+    const unsigned int obj_offset = (unsigned int)((uintptr_t) (obj - ((char *) page)));
+
+    if(page->sync.shared.thread_id == local_data->thread_id) /* Local case */
+    {
+        heap_t *local_heap = &local_data->private_heap[page->class_idx];
+
+        /* Push in local LIFO */
+        STACK_PUSH_OBJECT(page, (unsigned int *)obj, obj_offset);
+
+        /* Parked pageblock has space again - Unless a notification is pending, move it back */
+        if(page->parked && !page_unpark(local_heap, page))
+            return;
+
+        /* Check if the pageblock can be released back - Kept for a while, unless it is the head anyway */
+        if(!page->allocated_objects && local_heap->avail.head != page)
+        {
+            remove_node_dq(&local_heap->avail, page);
+            heap_keep_empty(local_data, page);
+        }
+    }
+    else /* Remote free, we do not own it */
+    {
+        page_remote_free(local_data, page, obj_offset, obj, 1);
+    }
+}
+
+/* Pushes a chain of objects in the remote LIFO of a pageblock we do not own - Paths 2a and 2b above.
+ * The chain is already linked from head_off down to tail, the tail gets linked to the old head. The freeing
+ * thread is passed, since forked children also free for the threads they did not inherit. */
+static void page_remote_free(thread_private_t *local_data, page_t *page, const unsigned int head_off, char *tail, const unsigned int count)
+{
+    const int class_idx = page->class_idx;
+    const unsigned int thread_id = local_data->thread_id;
+    rfid_un new_head;
+    rfid_un *obj_ptr = (rfid_un *) tail;
+    bool maybe_stolen, notify_owner;
+
+    do
+    {
+        /* Old head values init */
+        obj_ptr->both = page->sync.both;
+        new_head.both = obj_ptr->both;
+        maybe_stolen = notify_owner = false;
+
+        /* Steal case - Opportunistically try to also steal the pageblock in one go */
+        if(obj_ptr->shared.thread_id == ORPHAN_ID)
+        {
+            new_head.shared.thread_id = thread_id;
+            maybe_stolen = true;
+        }
+
+        /* Parked case - We are the first to free in an exhausted pageblock */
+        if(obj_ptr->shared.state == PAGE_STATE_PARKED)
+        {
+            new_head.shared.state = PAGE_STATE_NOTIFYING;
+            notify_owner = true;
+        }
+
+        /* Else update for insertion */
+        new_head.shared.remotely_freed = head_off;
+        new_head.shared.count += count;
+    }
+    while(!ATOMIC_CAS(&page->sync.both, &new_head.both, &obj_ptr->both, __ATOMIC_ACQ_REL));
+
+    local_data->stats[class_idx].remote_frees += count;
+
+    /* Successful steal means insertion in our list */
+    if(maybe_stolen && page->sync.shared.thread_id == thread_id)
+    {
+        DEBUG_TOTAL_STEALS();
+        local_data->stats[class_idx].steals++;
+        orphan_unpool(page, class_idx);
+        page->parked = 0;
+        page->notify = &local_data->notified;
+        insert_front_dq(&local_data->private_heap[class_idx].avail, page);
+    }
+
+    /* Push in the notification stack of the owner, which waits for us while NOTIFYING */
+    if(notify_owner)
+    {
+        page_t *volatile *owner_stack = page->notify;
+        page_t *old_top;
+        rfid_un old_head;
+
+        do
+        {
+            old_top = *owner_stack;
+            page->notify_next = old_top;
+        }
+        while(!ATOMIC_CAS(owner_stack, &page, &old_top, __ATOMIC_RELEASE));
+
+        /* Notification done - Only we can change the state out of NOTIFYING */
+        do
+        {
+            old_head.both = page->sync.both;
+            new_head = old_head;
+            new_head.shared.state = PAGE_STATE_NONE;
+        }
+        while(!ATOMIC_CAS(&page->sync.both, &new_head.both, &old_head.both, __ATOMIC_RELEASE));
+    }
+}
+
+/* Allocates a small object from the pageblocks of the class */
+static void *small_alloc(heap_t *local_heap, const int class_idx, const int page_num)
+{
+    /* Forked children - Our parked pageblocks are settled before we collect them */
+    fork_reclaim();
+
+    do
+    {
+        /* Allocate from the available pageblocks - Exhausted ones are parked, so this is mostly the head */
+        for(page_t *cur = local_heap->avail.head; cur; cur = local_heap->avail.head)
+        {
+            void *ret = page_internal_alloc(cur);
+            if(ret) return ret;
+
+            page_park(local_heap, cur);
+        }
+    }
+    while(heap_collect_notified(thread_data.private_heap, &thread_data.notified) || /* Parked ones with remote frees */
+          orphan_adopt(local_heap, class_idx));                                     /* Left by exited threads */
+
+    /* Kept empty pageblocks - Still initialized, their objects are all in the local LIFO */
+    if(local_heap->empty.head)
+    {
+        page_t *page = remove_front_dq(&local_heap->empty);
+
+        local_heap->empty_num--;
+        insert_front_dq(&local_heap->avail, page);
+
+        return page_internal_alloc(page);
+    }
+
+    /* Allocate and initialize a pageblock */
+    unsigned int zeroed_off;
+    void *alloc = get_pageblock(page_num, &zeroed_off);
+
+    /* Failure */
+    if(!alloc) return NULL;
+
+    /* Initialize page and link to list */
+    page_t *page = page_internal_init(alloc, class_idx, page_num, zeroed_off, thread_data.thread_id, &thread_data.notified);
+    thread_data.stats[class_idx].pageblocks++;
+    insert_front_dq(&local_heap->avail, page);
+
+    /* Allocate from the page and return */
+    return page_internal_alloc(page);
+}
+
+#ifdef FREE_CHECK_ACTIVE
+/* Double free found - Out of line, the free paths only test a bit */
+static void free_check_abort(void)
+{
+    PANIC_ERR("Double free detected, aborting..[free]\n");
+}
+
+/* Refilled objects enter a cache - Free from now on, as far as the check goes */
+static inline void *free_check_cache_in(void *obj)
+{
+    page_t *page;
+    object_page_decode(obj, &page);
+    FREE_MAP_SET(page, (uintptr_t)((char *)obj - (char *)page));
+
+    return obj;
+}
+
+/* Cached objects are handed out */
+static inline void *free_check_cache_out(void *obj)
+{
+    page_t *page;
+    object_page_decode(obj, &page);
+    FREE_MAP_POP(page, (uintptr_t)((char *)obj - (char *)page));
+
+    return obj;
+}
+
+    #define FREE_CHECK_CACHE_IN(obj)    free_check_cache_in((obj))
+    #define FREE_CHECK_CACHE_OUT(obj)   free_check_cache_out((obj))
+#else
+    #define FREE_CHECK_CACHE_IN(obj)    (obj)
+    #define FREE_CHECK_CACHE_OUT(obj)   (obj)
+#endif
+
+/* Frees a small object of a known class in the thread cache */
+static inline void small_free(void *obj, const int class_idx)
+{
+    thread_private_t *local_data = &thread_data;    /* Thread local storage reference */
+    tcache_t *cache = &local_data->cache[class_idx];
+
+#ifdef FREE_CHECK_ACTIVE
+    /* Already in a cache or in the freed LIFO of its pageblock - Cached from now on */
+    page_t *page;
+    object_page_decode(obj, &page);
+    FREE_MAP_PUSH(page, (uintptr_t)((char *)obj - (char *)page));
+#endif
+
+#ifdef PERCPU_CACHE_ACTIVE
+    /* Fast path - Cache of our CPU, once full half of it goes back through the thread cache */
+    if(percpu_caches)
+    {
+        cache->frees++;
+        if(!percpu_push(class_idx, obj)) percpu_drain(cache, class_idx, obj);
+        return;
+    }
+#endif
+
+    /* Cache is full - Return a batch to the pageblocks. The depth shares the line of the count */
+    if(cache->count >= cache->depth)
+        tcache_drain(local_data, class_idx, cache->depth >> 1);
+
+    /* Fast path - Thread cache, a forked child never finds the count ahead of its slot */
+    cache->frees++;
+    cache->objects[cache->count] = obj;
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    cache->count++;
+}
+
+/* Adopts an orphaned pageblock of the class from the pool - Returns 1 if the available list got one */
+static int orphan_adopt(heap_t *local_heap, const int class_idx)
+{
+    rfid_un old_head, new_head;
+    page_t *page;
+
+    /* Racy check - Empty most of the times */
+    while(orphan_pool[class_idx].head)
+    {
+        spin_lock(&orphan_lock[class_idx]);
+
+        if((page = orphan_pool[class_idx].head))
+        {
+            remove_front_dq(&orphan_pool[class_idx]);
+            page->pooled = 0;
+        }
+
+        spin_unlock(&orphan_lock[class_idx]);
+
+        if(!page) return 0;
+
+        /* Only a remote free can race us - If it stole the pageblock first, it is theirs */
+        do
+        {
+            old_head.both = page->sync.both;
+            if(old_head.shared.thread_id != ORPHAN_ID) break;
+
+            new_head = old_head;
+            new_head.shared.thread_id = thread_data.thread_id;
+        }
+        while(!ATOMIC_CAS(&page->sync.both, &new_head.both, &old_head.both, __ATOMIC_ACQUIRE));
+
+        if(old_head.shared.thread_id != ORPHAN_ID) continue;
+
+        thread_data.stats[class_idx].steals++;
+        page->parked = 0;
+        page->notify = &thread_data.notified;
+        insert_front_dq(&local_heap->avail, page);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Takes a stolen pageblock out of the orphan pool, if it was still there */
+static void orphan_unpool(page_t *page, const int class_idx)
+{
+    spin_lock(&orphan_lock[class_idx]);
+
+    if(page->pooled)
+    {
+        unlink_dq(&orphan_pool[class_idx], page);
+        page->pooled = 0;
+    }
+
+    spin_unlock(&orphan_lock[class_idx]);
+}
+
+/* Refills the thread cache of a class - Returns one object and caches up to a batch from the same pageblock */
+static void *tcache_refill(tcache_t *cache, heap_t *local_heap, const int class_idx, const int page_num, const size_t sz)
+{
+    const thread_busy_t busy;
+
+    /* Above the configured limit - These caches are always empty, so the fast path needs no check */
+    if(class_idx >= small_classes) return large_alloc_sampled(sz, 0);
+
+    void *ret = small_alloc(local_heap, class_idx, page_num);
+    void *obj;
+
+    /* Failure */
+    if(!ret) return NULL;
+
+    cache->allocs++;
+
+    /* The available head is where the object came from - Do not fetch new pageblocks for the cache */
+    while(cache->count < (cache->depth >> 1) && (obj = page_internal_alloc(local_heap->avail.head)))
+        cache->objects[cache->count++] = FREE_CHECK_CACHE_IN(obj);
+
+    /* Reverse them, so that they are handed out in the order the pageblock gave them */
+    for(unsigned int i = 0; i < (cache->count >> 1); i++)
+    {
+        obj = cache->objects[i];
+        cache->objects[i] = cache->objects[cache->count - i - 1];
+        cache->objects[cache->count - i - 1] = obj;
+    }
+
+    /* Everything the cache got counts towards the next sample */
+    if(prof_due((cache->count + 1) * class_sizes[class_idx])) return prof_sample_small(cache, ret, sz, 0);
+
+    return ret;
+}
+
+/* Chains a remote free with the others of its pageblock - With no room for another chain, the last one is pushed first */
+static inline void remote_chain_add(remote_chain_t *chains, unsigned int *chains_num, thread_private_t *local_data, page_t *page, char *obj,
+                                    const unsigned int obj_offset)
+{
+    unsigned int j;
+
+    for(j = 0; j < *chains_num && chains[j].page != page; j++);
+
+    if(j < *chains_num)
+    {
+        ((rfid_un *)obj)->shared.remotely_freed = chains[j].head_off;
+        chains[j].head_off = obj_offset;
+        chains[j].count++;
+        return;
+    }
+
+    if(j == REMOTE_CHAINS)
+    {
+        j--;
+        page_remote_free(local_data, chains[j].page, chains[j].head_off, chains[j].tail, chains[j].count);
+    }
+    else
+    {
+        (*chains_num)++;
+    }
+
+    chains[j].page = page;
+    chains[j].tail = obj;
+    chains[j].head_off = obj_offset;
+    chains[j].count = 1;
+}
+
+/* Returns the oldest objects of a thread cache to their pageblocks - On behalf of the thread that owns the cache */
+static void tcache_drain(thread_private_t *local_data, const int class_idx, const unsigned int objects_num)
+{
+    const thread_busy_t busy;
+    tcache_t *cache = &local_data->cache[class_idx];
+    remote_chain_t chains[REMOTE_CHAINS];
+    unsigned int chains_num = 0, j;
+
+    /* Forked children - Not for the copies, they are drained by the reclaim itself */
+    if(local_data == &thread_data) fork_reclaim();
+
+    for(unsigned int i = 0; i < objects_num; i++)
+    {
+        char *obj = (char *)cache->objects[i];
+
+        /* Objects in the cache are always small and valid */
+        page_t *page;
+        object_page_decode(obj, &page);
+        const unsigned int obj_offset = (unsigned int)((uintptr_t) (obj - ((char *) page)));
+
+        /* Out of the cache - The freed LIFO tests it again, before the pageblock can hand it out */
+        FREE_MAP_POP(page, obj_offset);
+
+        /* Ours - Only we can change that */
+        if(page->sync.shared.thread_id == local_data->thread_id)
+        {
+            page_internal_free(local_data, page, obj);
+            continue;
+        }
+
+        /* Remote - Chain it with the rest of its pageblock */
+        remote_chain_add(chains, &chains_num, local_data, page, obj, obj_offset);
+    }
+
+    /* One CAS per pageblock */
+    for(j = 0; j < chains_num; j++)
+        page_remote_free(local_data, chains[j].page, chains[j].head_off, chains[j].tail, chains[j].count);
+
+    /* Shift the rest to the bottom */
+    cache->count -= objects_num;
+    memmove(cache->objects, cache->objects + objects_num, cache->count * sizeof(void *));
+}
+
+#ifdef PERCPU_CACHE_ACTIVE
+/* Restartable sequence of the per-CPU caches - The descriptor of the sequence from start_label to commit_label is set in the rseq area
+ * of the thread, the kernel moves us to abort_label when we are preempted, migrated or signaled in there */
+#define RSEQ_ASM_BEGIN(cs_label, start_label, commit_label, abort_label)                         \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                                                        \
+    ".balign 32\n\t"                                                                            \
+    cs_label ":\n\t"                                                                            \
+    ".long 0x0, 0x0\n\t"                                                                        \
+    ".quad " start_label "f, (" commit_label "f - " start_label "f), " abort_label "f\n\t"      \
+    ".popsection\n\t"                                                                           \
+    "leaq " cs_label "b(%%rip), %%rax\n\t"                                                      \
+    "movq %%rax, %[rseq_cs]\n\t"                                                                \
+    start_label ":\n\t"
+
+/* Signature before the abort handlers - The RSEQ_SIG glibc registered, checked at compile time */
+#define RSEQ_SIG_STR    "0x53053053"
+
+#define RSEQ_ASM_ABORT(abort_label, retry)                                                      \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                                                   \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                                                \
+    ".long " RSEQ_SIG_STR "\n\t"                                                                \
+    abort_label ":\n\t"                                                                         \
+    "jmp %l[" retry "]\n\t"                                                                     \
+    ".popsection\n\t"
+
+/* Restartable sequences area of the calling thread */
+static inline struct rseq *rseq_area(void)
+{
+    return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+/* Maps the per-CPU caches if glibc registered rseq for the threads - Called once, with the thread cache depth known */
+static void percpu_init(void)
+{
+    const unsigned int cpus = possible_detect("/sys/devices/system/cpu/possible");
+
+    /* Disabled through the glibc tunables or by an old kernel - The thread caches do it */
+    if(!__rseq_size || (int)rseq_area()->cpu_id < 0 || !cpus) return;
+
+    const size_t stride = (CLASS_NUM * sizeof(pcache_t) + PAGE_SZ - 1) & ~ALIGN_MASK(PAGE_SZ);
+    char *caches = (char *)mmap_wrap(cpus * (stride >> PAGE_BITS));
+
+    if(!caches) return;
+
+    percpu_stride = stride;
+    percpu_cpus = cpus;
+    ATOMIC_STORE(&percpu_caches, &caches, __ATOMIC_RELEASE);
+}
+
+/* Pops an object from the cache of the class on our CPU - Returns NULL if it is empty */
+static inline void *percpu_pop(const int class_idx)
+{
+    struct rseq *rs = rseq_area();
+    pcache_t *base = (pcache_t *)percpu_caches + class_idx;
+    void *obj;
+
+retry:
+    /* cache = base + cpu * stride, obj = cache->objects[count - 1], then the count drops in the committing store */
+    __asm__ __volatile__ goto(
+        RSEQ_ASM_BEGIN("3", "1", "2", "4")
+        "movl %[cpu_id], %%eax\n\t"
+        "imulq %[stride], %%rax\n\t"
+        "addq %[base], %%rax\n\t"
+        "movq (%%rax), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz %l[empty]\n\t"
+        "movq (%%rax, %%rcx, 8), %[obj]\n\t"
+        "decq %%rcx\n\t"
+        "movq %%rcx, (%%rax)\n\t"
+        "2:\n\t"
+        RSEQ_ASM_ABORT("4", "retry")
+        : [obj] "=&r" (obj)
+        : [rseq_cs] "m" (rs->rseq_cs), [cpu_id] "m" (rs->cpu_id), [stride] "r" (percpu_stride), [base] "r" (base)
+        : "memory", "cc", "rax", "rcx"
+        : empty, retry);
+
+    return obj;
+
+empty:
+    return NULL;
+}
+
+/* Pushes an object in the cache of the class on our CPU - Returns 0 if it is full */
+static inline int percpu_push(const int class_idx, void *obj)
+{
+    struct rseq *rs = rseq_area();
+    pcache_t *base = (pcache_t *)percpu_caches + class_idx;
+    const unsigned long int depth = tcache_depth;
+
+retry:
+    /* cache = base + cpu * stride, cache->objects[count] = obj, then the count grows in the committing store */
+    __asm__ __volatile__ goto(
+        RSEQ_ASM_BEGIN("3", "1", "2", "4")
+        "movl %[cpu_id], %%eax\n\t"
+        "imulq %[stride], %%rax\n\t"
+        "addq %[base], %%rax\n\t"
+        "movq (%%rax), %%rcx\n\t"
+        "cmpq %[depth], %%rcx\n\t"
+        "jae %l[full]\n\t"
+        "movq %[obj], 8(%%rax, %%rcx, 8)\n\t"
+        "incq %%rcx\n\t"
+        "movq %%rcx, (%%rax)\n\t"
+        "2:\n\t"
+        RSEQ_ASM_ABORT("4", "retry")
+        :
+        : [rseq_cs] "m" (rs->rseq_cs), [cpu_id] "m" (rs->cpu_id), [stride] "r" (percpu_stride), [base] "r" (base),
+          [depth] "r" (depth), [obj] "r" (obj)
+        : "memory", "cc", "rax", "rcx"
+        : full, retry);
+
+    return 1;
+
+full:
+    return 0;
+}
+
+/* Refills the cache of our CPU through the thread cache - Returns one object, the rest of the batch goes to the CPU */
+static void *percpu_refill(tcache_t *cache, heap_t *local_heap, const int class_idx, const int page_num, const size_t sz)
+{
+    const thread_busy_t busy;
+    void *ret = tcache_refill(cache, local_heap, class_idx, page_num, sz);
+    unsigned int pushed = 0;
+
+    /* Bottom first, so that they are handed out in the order the pageblock gave them */
+    while(pushed < cache->count && percpu_push(class_idx, cache->objects[pushed])) pushed++;
+
+    /* Migrated to a CPU with a full cache meanwhile - The rest go back */
+    if(pushed < cache->count)
+    {
+        cache->count -= pushed;
+        memmove(cache->objects, cache->objects + pushed, cache->count * sizeof(void *));
+        tcache_drain(&thread_data, class_idx, cache->count);
+    }
+
+    cache->count = 0;
+
+    return ret;
+}
+
+/* Returns half of the cache of our CPU and an object to their pageblocks through the thread cache */
+static void percpu_drain(tcache_t *cache, const int class_idx, void *obj)
+{
+    const thread_busy_t busy;
+    void *cur;
+
+    while(cache->count < (cache->depth >> 1) && (cur = percpu_pop(class_idx)))
+        cache->objects[cache->count++] = cur;
+
+    cache->objects[cache->count++] = obj;
+
+    tcache_drain(&thread_data, class_idx, cache->count);
+}
+#endif
+
+/* Moves an exhausted pageblock from the available list to the full list - Returns 0 if it has remote frees */
+static int page_park(heap_t *local_heap, page_t *page)
+{
+    rfid_un old_head, new_head;
+
+    do
+    {
+        old_head.both = page->sync.both;
+
+        /* Remote frees arrived - Allocating from the pageblock will collect them */
+        if(old_head.shared.remotely_freed) return 0;
+
+        /* From now on the first remote free notifies us */
+        new_head = old_head;
+        new_head.shared.state = PAGE_STATE_PARKED;
+    }
+    while(!ATOMIC_CAS(&page->sync.both, &new_head.both, &old_head.both, __ATOMIC_RELEASE));
+
+    unlink_dq(&local_heap->avail, page);
+    insert_front_dq(&local_heap->full, page);
+    page->parked = 1;
+
+    return 1;
+}
+
+/* Moves a parked pageblock back to the available list - Returns 0 if a remote free already notified us */
+static int page_unpark(heap_t *local_heap, page_t *page)
+{
+    rfid_un old_head, new_head;
+
+    do
+    {
+        old_head.both = page->sync.both;
+
+        /* The pageblock is (or will be) in the notification stack, collecting it will move it */
+        if(old_head.shared.state != PAGE_STATE_PARKED) return 0;
+
+        new_head = old_head;
+        new_head.shared.state = PAGE_STATE_NONE;
+    }
+    while(!ATOMIC_CAS(&page->sync.both, &new_head.both, &old_head.both, __ATOMIC_RELAXED));
+
+    unlink_dq(&local_heap->full, page);
+    insert_tail_dq(&local_heap->avail, page);
+    page->parked = 0;
+
+    return 1;
+}
+
+/* Keeps a pageblock that has no live objects anymore - Too many of them and the oldest go back in a batch */
+static void heap_keep_empty(thread_private_t *local_data, page_t *page)
+{
+    heap_t *local_heap = &local_data->private_heap[page->class_idx];
+
+    insert_front_dq(&local_heap->empty, page);
+
+    if(++local_heap->empty_num > 2 * empty_pageblocks) heap_release_empty(local_data, page->class_idx, empty_pageblocks);
+}
+
+/* Returns the oldest empty pageblocks of a class until kept are left - Returns 1 if any was released */
+static int heap_release_empty(thread_private_t *local_data, const int class_idx, const unsigned int kept)
+{
+    heap_t *local_heap = &local_data->private_heap[class_idx];
+    int ret = 0;
+
+    while(local_heap->empty_num > kept)
+    {
+        page_t *page = remove_tail_dq(&local_heap->empty);
+
+        local_heap->empty_num--;
+        local_data->stats[class_idx].pageblocks--;
+        ret_pageblock((void *)page, page->page_num);
+        ret = 1;
+    }
+
+    return ret;
+}
+
+/* Moves every parked pageblock that got remote frees back to its available list - Returns 0 if there were none */
+static int heap_collect_notified(heap_t *local_heaps, page_t *volatile *notified)
+{
+    page_t *cur, *next;
+    rfid_un head;
+
+    /* Avoid the atomic operation in the common case */
+    if(!*notified) return 0;
+
+    for(cur = ATOMIC_EXCHANGE(notified, NULL, __ATOMIC_ACQUIRE); cur; cur = next)
+    {
+        heap_t *local_heap = &local_heaps[cur->class_idx];
+        next = cur->notify_next;
+
+        /* The remote free that pushed it might not be done yet */
+        PAGE_SYNC_SETTLED(cur, head);
+
+        unlink_dq(&local_heap->full, cur);
+        insert_tail_dq(&local_heap->avail, cur);
+        cur->parked = 0;
+    }
+
+    return 1;
+}
+
+/* Performs compile time checks - Asserts compiler error in case of failure */
+void compile_check_dummy(void)
+{
+    /* CTC - Compile Time Check
+     * Mostly checks some assumptions that are more or less pretty common, but
+     * in any case we should have a safeguard. */
+
+    /* Counting atomic list node - Compare and exchange for 64bits only */
+    CTC((sizeof(dq_ct_node) == 8));
+    CTC((sizeof(rfid) == 8));
+
+    /* Headers are 1-byte, else everything is doomed */
+    CTC((sizeof(header_t) == 1));
+
+    /* Minimum class is 7 effective bytes - So int offsets is all we have */
+    CTC((sizeof(int) == 4));
+
+    /* Sometimes long int is used as an alias for pointers and compare and exchange */
     CTC((sizeof(long int) == 8));
     CTC((sizeof(void *) == 8));
     CTC((sizeof(size_t) == 8));
+
+    /* Both x86-64 and aarch64 - The 64bit swaps are single instructions, never library locks */
+    CTC((__atomic_always_lock_free(sizeof(unsigned long int), 0)));
+
+    /* The bit-fields of the counting nodes and the sync words are laid out from the least significant bit */
+    CTC((__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__));
+    CTC((PTR_BITS + COUNT_BITS + STATE_BITS == 64));
+
+    /* The owner and the shared lines of the pageblock headers */
+    CTC((offsetof(page_t, sync) == CACHE_LINE_SZ));
+    CTC((sizeof(page_t) == 2 * CACHE_LINE_SZ));
+
+#ifdef PERCPU_CACHE_ACTIVE
+    /* The restartable sequences hardcode the layout of the per-CPU caches and the signature */
+    CTC((offsetof(pcache_t, objects) == sizeof(unsigned long int)));
+    CTC((RSEQ_SIG == 0x53053053));
+#endif
+}
+
+void *malloc(size_t sz)
+{
+    /* Check input - 0 byte allocations not supported */
+    if(!sz) return NULL;
+
+    DEBUG_COUNT_MALLOCS();
+
+    /* Small allocations go to the front-end */
+    if(sz < SMALL_ALLOCATION_LIMIT)
+    {
+        /* Get the class information */
+        int page_num;
+        int class_idx = class_size_decode(SMALL_CLASS_REQUEST(sz), &page_num);
+        tcache_t *cache = &thread_data.cache[class_idx];
+
+        DEBUG_REAL_TOTAL_ALLOC(class_sizes[class_idx]);
+
+#ifdef PERCPU_CACHE_ACTIVE
+        /* Fast path - Cache of our CPU, refilled through the thread cache */
+        if(percpu_caches)
+        {
+            void *obj = percpu_pop(class_idx);
+
+            if(!obj) return percpu_refill(cache, &thread_data.private_heap[class_idx], class_idx, page_num, sz);
+
+            cache->allocs++;
+            return FREE_CHECK_CACHE_OUT(obj);
+        }
+#endif
+
+        /* Fast path - Thread cache */
+        if(cache->count)
+        {
+            cache->allocs++;
+            return FREE_CHECK_CACHE_OUT(cache->objects[--cache->count]);
+        }
+
+        /* Refill from the pageblocks */
+        return tcache_refill(cache, &thread_data.private_heap[class_idx], class_idx, page_num, sz);
+    }
+
+    /* Perform large allocation */
+    return large_alloc_sampled(sz, 0);
+}
+
+void *calloc(size_t nmemb, size_t sz)
+{
+    const size_t total_alloc = nmemb * sz;
+
+    /* Overflow found */
+    if (nmemb != 0 && total_alloc / nmemb != sz) return NULL;
+
+    /* Large allocations know where their memory came from */
+    if(total_alloc >= small_limit)
+    {
+        DEBUG_COUNT_MALLOCS();
+        return large_alloc_sampled(total_alloc, 1);
+    }
+
+    /* Small allocations - Bump from the available head, if its unallocated area was never written */
+    if(total_alloc)
+    {
+        int page_num;
+        const int class_idx = class_size_decode(SMALL_CLASS_REQUEST(total_alloc), &page_num);
+        page_t *page = thread_data.private_heap[class_idx].avail.head;
+        void *ptr;
+
+        if(page && page->unallocated_off >= page->zeroed_off && (ptr = page_internal_bump(page)))
+        {
+            thread_data.cache[class_idx].allocs++;
+            DEBUG_COUNT_MALLOCS();
+            DEBUG_REAL_TOTAL_ALLOC(class_sizes[class_idx]);
+
+            /* Fresh mappings of the sample are zero too */
+            if(prof_due(class_sizes[class_idx])) return prof_sample_small(&thread_data.cache[class_idx], ptr, total_alloc, 1);
+
+            return ptr;
+        }
+    }
+
+    /* Call malloc and set to 0*/
+    void *ptr = malloc(total_alloc);
+    if(ptr) memset(ptr, 0, total_alloc);
+
+    return ptr;
+}
+
+void *realloc(void *obj, size_t sz)
+{
+    page_t *page;
+    size_t old_sz;
+    void *ret = obj;
+
+    /* 0 size is not supported */
+    if(!obj) return malloc(sz);
+    if(!sz) return ret;
+
+    DEBUG_COUNT_REALLOCS();
+
+    /* Find the type of object */
+    switch(object_page_decode(obj, &page))
+    {
+        case CLASS_SMALL:
+        {
+            /* We also need to account for the header size */
+            const int object_size = page->object_size;
+            int page_num;
+            old_sz = object_size - SMALL_HEADER_SIZE;
+
+            /* Still of the same class - Simply return the same. Smaller classes move, so that sized frees find the class */
+            if(old_sz >= sz && class_sizes[class_size_decode(SMALL_CLASS_REQUEST(sz), &page_num)] == object_size) return ret;
+            break;
+        }
+        case CLASS_LARGE:
+        {
+            old_sz = large_usable_size(obj);
+
+            /* Stays large - Resize the mapping without copying */
+            if(sz >= small_limit && (ret = large_realloc(obj, sz))) return ret;
+            break;
+        }
+        default: PANIC_ERR("Broken object, aborting [realloc]..\n");
+    }
+
+    /* Malloc - Copy - Free */
+    ret = malloc(sz);
+
+    /* Move the allocation to the new block */
+    if(ret)
+    {
+        memcpy(ret, obj, (old_sz < sz) ? old_sz : sz);
+        free(obj);
+    }
+
+    return ret;
+}
+
+void free(void *obj)
+{
+    page_t *page;                                   /* Pageblock of small objects */
+
+    /* Empty - Before touching the thread data, threads exit with free(NULL) calls after their destructors ran */
+    if(!obj) return;
+
+    DEBUG_COUNT_FREES();
+
+    /* Find the type of object and its pageblock */
+    switch(object_page_decode(obj, &page))
+    {
+        case CLASS_SMALL: break; /* Handle below */
+        case CLASS_LARGE: large_free(obj); return;
+        default: PANIC_ERR("Broken object, aborting..[free]\n");
+    }
+
+    /* The class is kept in the pageblock */
+    small_free(obj, page->class_idx);
+}
+
+/* Sized free - The size is the one requested, so the class is found without touching the pageblock */
+void free_sized(void *obj, size_t sz)
+{
+    int page_num;
+
+    if(!obj) return;
+
+    DEBUG_COUNT_FREES();
+
+    /* Large objects have their header next to them anyway - Sampled small ones are large too */
+    if(sz >= small_limit)
+    {
+        large_free(obj);
+        return;
+    }
+
+    if(prof_interval)
+    {
+        free(obj);
+        return;
+    }
+
+    small_free(obj, class_size_decode(SMALL_CLASS_REQUEST(sz), &page_num));
+}
+
+/* Sized free of the aligned allocations - Same alignment and size as requested */
+void free_aligned_sized(void *obj, size_t alignment, size_t sz)
+{
+    const size_t small_sz = aligned_small_size(alignment, sz);
+    int page_num;
+
+    if(!obj) return;
+
+    DEBUG_COUNT_FREES();
+
+    if(!small_sz)
+    {
+        large_free(obj);
+        return;
+    }
+
+    if(prof_interval)
+    {
+        free(obj);
+        return;
+    }
+
+    small_free(obj, class_size_decode(SMALL_CLASS_REQUEST(small_sz), &page_num));
+}
+
+/* Allocates up to num objects of the same size in ptrs - Returns how many were allocated. Small ones come from the thread cache
+ * and then straight from the pageblocks of their class, which is decoded once */
+size_t malloc_batch(size_t sz, void **ptrs, size_t num)
+{
+    const thread_busy_t busy;
+    size_t allocated = 0;
+
+    if(!sz) return 0;
+
+    /* Large ones, and small ones while profiling (every allocation counts towards a sample), one by one */
+    if(sz >= small_limit || prof_interval)
+    {
+        for(; allocated < num && (ptrs[allocated] = malloc(sz)); allocated++);
+        return allocated;
+    }
+
+    int page_num;
+    const int class_idx = class_size_decode(SMALL_CLASS_REQUEST(sz), &page_num);
+    tcache_t *cache = &thread_data.cache[class_idx];
+    heap_t *local_heap = &thread_data.private_heap[class_idx];
+
+    while(allocated < num && cache->count) ptrs[allocated++] = FREE_CHECK_CACHE_OUT(cache->objects[--cache->count]);
+
+    while(allocated < num)
+    {
+        page_t *page = local_heap->avail.head;
+        void *obj;
+
+        /* The available head as long as it lasts */
+        while(allocated < num && page && (obj = page_internal_alloc(page))) ptrs[allocated++] = obj;
+
+        /* Exhausted - Parked and the next one, or a new one, gives one more */
+        if(allocated == num || !(ptrs[allocated] = small_alloc(local_heap, class_idx, page_num))) break;
+        allocated++;
+    }
+
+    cache->allocs += allocated;
+
+    return allocated;
+}
+
+/* Frees num objects of ptrs, NULL ones are skipped - Consecutive objects of the same pageblock decode its class once,
+ * local frees go straight to their pageblocks and remote ones are pushed with a CAS per pageblock */
+void free_batch(void **ptrs, size_t num)
+{
+    const thread_busy_t busy;
+    thread_private_t *local_data = &thread_data;    /* Thread local storage reference */
+    remote_chain_t chains[REMOTE_CHAINS];
+    unsigned int chains_num = 0;
+    page_t *last = NULL;
+    tcache_t *cache = NULL;
+
+    /* Forked children - Our lists are settled before we move pageblocks around */
+    fork_reclaim();
+
+    for(size_t i = 0; i < num; i++)
+    {
+        char *obj = (char *)ptrs[i];
+        page_t *page;
+
+        if(!obj) continue;
+
+        switch(object_page_decode(obj, &page))
+        {
+            case CLASS_SMALL: break; /* Handle below */
+            case CLASS_LARGE: large_free(obj); continue;
+            default: PANIC_ERR("Broken object, aborting..[free_batch]\n");
+        }
+
+        const unsigned int obj_offset = (unsigned int)((uintptr_t) (obj - ((char *) page)));
+
+#ifdef FREE_CHECK_ACTIVE
+        if(FREE_MAP_TEST(page, obj_offset)) free_check_abort();
+#endif
+
+        if(page != last)
+        {
+            cache = &local_data->cache[page->class_idx];
+            last = page;
+        }
+
+        cache->frees++;
+
+        /* Ours - Only we can change that */
+        if(page->sync.shared.thread_id == local_data->thread_id)
+        {
+            page_internal_free(local_data, page, obj);
+            continue;
+        }
+
+        remote_chain_add(chains, &chains_num, local_data, page, obj, obj_offset);
+    }
+
+    /* One CAS per pageblock */
+    for(unsigned int j = 0; j < chains_num; j++)
+        page_remote_free(local_data, chains[j].page, chains[j].head_off, chains[j].tail, chains[j].count);
+}
+
+/* Usable bytes of an object - Up to the end of its class or its pages */
+size_t malloc_usable_size(void *obj)
+{
+    page_t *page;
+
+    if(!obj) return 0;
+
+    switch(object_page_decode(obj, &page))
+    {
+        case CLASS_SMALL: return page->object_size - SMALL_HEADER_SIZE;
+        case CLASS_LARGE: return large_usable_size(obj);
+        default: PANIC_ERR("Broken object, aborting..[malloc_usable_size]\n");
+    }
+
+    return 0;
+}
+
+/* Request size of the power of two class an aligned allocation comes from - 0 if it is a large one */
+static size_t aligned_small_size(const size_t alignment, const size_t sz)
+{
+    /* Every object is aligned at this already */
+    if(alignment <= DEFAULT_ALLIGN) return (sz < small_limit) ? sz : 0;
+
+    /* Smallest multiple of the alignment that fits the object with its header - Either it is a class or the next
+     * class, of a coarser step, is. Both are aligned at a multiple of the alignment */
+    if(sz < small_limit && alignment <= small_limit)
+    {
+        const size_t min_sz = (sz + SMALL_HEADER_SIZE + ALIGN_MASK(alignment)) & ~ALIGN_MASK(alignment);
+
+        if(min_sz < small_limit + SMALL_HEADER_SIZE) return min_sz - SMALL_HEADER_SIZE;
+    }
+
+    return 0;
+}
+
+/* Serves an aligned allocation - The alignment has to be a power of two */
+static void *aligned_malloc(const size_t alignment, const size_t sz)
+{
+    const size_t small_sz = aligned_small_size(alignment, sz);
+
+    if(small_sz) return malloc(small_sz);
+
+    /* Large allocations are aligned at the header size only */
+    if(alignment <= DEFAULT_ALLIGN) return malloc(sz);
+
+    /* Overflow of the extra pages */
+    if(sz > SIZE_MAX - alignment - PAGE_SZ) return NULL;
+
+    DEBUG_COUNT_MALLOCS();
+
+    void *ret = large_aligned_alloc(sz, alignment);
+    if(ret && prof_due(sz)) prof_sample_large(ret, sz);
+
+    return ret;
+}
+
+/* Allocation with extra requirements - See the flags in allocator.h */
+void *malloc_ex(size_t sz, int flags)
+{
+    if(!sz) return NULL;
+
+    if(flags & XMALLOC_CACHE_LINE)
+    {
+        /* Padded to whole lines - Overflow leaves 0. With headers the class has one more line, holding only the next header */
+        sz = (sz + ALIGN_MASK(CACHE_LINE_SZ)) & ~((size_t)ALIGN_MASK(CACHE_LINE_SZ));
+
+        return sz ? aligned_malloc(CACHE_LINE_SZ, sz) : NULL;
+    }
+
+    return malloc(sz);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t sz)
+{
+    /* Power of two multiple of sizeof(void *) */
+    if(!IS_POWER_OF_TWO(alignment) || alignment < sizeof(void *)) return EINVAL;
+
+    /* 0 byte allocations not supported - Same as malloc */
+    if(!sz)
+    {
+        *memptr = NULL;
+        return 0;
+    }
+
+    void *ret = aligned_malloc(alignment, sz);
+    if(!ret) return ENOMEM;
+
+    *memptr = ret;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t sz)
+{
+    if(!alignment || !IS_POWER_OF_TWO(alignment))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return sz ? aligned_malloc(alignment, sz) : NULL;
+}
+
+void *memalign(size_t alignment, size_t sz)
+{
+    return aligned_alloc(alignment, sz);
+}
+
+void *valloc(size_t sz)
+{
+    return sz ? aligned_malloc(PAGE_SZ, sz) : NULL;
+}
+
+void *pvalloc(size_t sz)
+{
+    /* Rounded up to whole pages - Overflow leaves 0 */
+    sz = (sz + ALIGN_MASK(PAGE_SZ)) & ~((size_t)ALIGN_MASK(PAGE_SZ));
+
+    return sz ? aligned_malloc(PAGE_SZ, sz) : NULL;
+}
+
+void *operator new(std::size_t count)
+{
+    return malloc(count);
+}
+
+void *operator new[](std::size_t count)
+{
+    return malloc(count);
+}
+
+void *operator new(std::size_t count, const std::nothrow_t &tag)
+{
+    return malloc(count);
+}
+
+void *operator new[](std::size_t count, const std::nothrow_t &tag)
+{
+    return malloc(count);
+}
+
+void operator delete(void *ptr)
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr)
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &tag)
+{
+    free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t &tag)
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t sz)
+{
+    free_sized(ptr, sz);
+}
+
+void operator delete[](void *ptr, std::size_t sz)
+{
+    free_sized(ptr, sz);
+}
+
+#ifdef __cpp_aligned_new
+void *operator new(std::size_t count, std::align_val_t al)
+{
+    return aligned_malloc((size_t)al, count);
+}
+
+void *operator new[](std::size_t count, std::align_val_t al)
+{
+    return aligned_malloc((size_t)al, count);
+}
+
+void *operator new(std::size_t count, std::align_val_t al, const std::nothrow_t &tag)
+{
+    return aligned_malloc((size_t)al, count);
+}
+
+void *operator new[](std::size_t count, std::align_val_t al, const std::nothrow_t &tag)
+{
+    return aligned_malloc((size_t)al, count);
+}
+
+void operator delete(void *ptr, std::align_val_t al)
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t al)
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t al, const std::nothrow_t &tag)
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t al, const std::nothrow_t &tag)
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t sz, std::align_val_t al)
+{
+    free_aligned_sized(ptr, (size_t)al, sz);
+}
+
+void operator delete[](void *ptr, std::size_t sz, std::align_val_t al)
+{
+    free_aligned_sized(ptr, (size_t)al, sz);
+}
+#endif
+
+/* Gives away the pageblock of a small object of ours - The first thread that frees into it becomes its owner, so
+ * its later frees there are local. For producer/consumer pairs: the producer hands off the pageblocks of the objects
+ * it passes on. Returns 0 on success, -1 if the object is not a small one of a pageblock we own.
+ * Handed off pageblocks are not pooled for adoption, nobody allocates from them until they are stolen. */
+int xmalloc_handoff(void *obj)
+{
+    thread_private_t *local_data = &thread_data;
+    rfid_un old_head, new_head;
+    page_t *page;
+
+    if(!obj || object_page_decode(obj, &page) != CLASS_SMALL || !page) return -1;
+    if(page->sync.shared.thread_id != local_data->thread_id) return -1;
+
+    /* Forked children - A parked pageblock may still be notifying from a thread left behind */
+    fork_reclaim();
+
+    const int class_idx = page->class_idx;
+    heap_t *local_heap = &local_data->private_heap[class_idx];
+
+    /* Parked ones go back to the available list - A remote free that notified us finishes the push first */
+    if(page->parked && !page_unpark(local_heap, page))
+    {
+        PAGE_SYNC_SETTLED(page, old_head);
+        heap_collect_notified(local_data->private_heap, &local_data->notified);
+    }
+
+    /* Nothing is live in there - Stays ours, nobody would ever free into it */
+    old_head.both = page->sync.both;
+    if(old_head.shared.count == page->allocated_objects) return -1;
+
+    unlink_dq(&local_heap->avail, page);
+
+    /* Not parked, so remote frees only push - They steal it from now on */
+    do
+    {
+        old_head.both = page->sync.both;
+        new_head = old_head;
+        new_head.shared.thread_id = ORPHAN_ID;
+    }
+    while(!ATOMIC_CAS(&page->sync.both, &new_head.both, &old_head.both, __ATOMIC_RELEASE));
+
+    return 0;
 }
 
-void *malloc(size_t sz)
+/* Gives back to the OS the memory of the cached pageblocks and large allocations of the calling thread and of the global
+ * caches, regardless of their age. The caches of other threads are theirs, bounded by local_cache_depth and large_local_cache.
+ * The padding has no meaning here, nothing is kept at the top of a heap. Returns 1 if memory was released. */
+int malloc_trim(size_t pad)
 {
-    /* Check input - 0 byte allocations not supported */
-    if(!sz) return NULL;
+    const thread_busy_t busy;
+    int ret = 0;
 
-    DEBUG_COUNT_MALLOCS();
+    /* Forked children - The heaps of the threads left behind first */
+    fork_reclaim();
 
-    /* Small allocations go to the front-end */
-    if(sz < SMALL_ALLOCATION_LIMIT)
+    /* Our empty pageblocks go to the caches first */
+    for(int i = 0; i < CLASS_NUM; i++)
+        heap_release_empty(&thread_data, i, 0);
+
+    /* Pageblocks - Ours and the global ones */
+    for(int i = 0; i < CLASS_PAGES_NUM; i++)
+        ret |= cache_purge(&thread_data.top[i], PAGE_SZ_BY_IDX(i), ULONG_MAX, 0);
+
+    spin_lock(&purge_lock);
+
+    for(unsigned int n = 0; n < numa_nodes; n++)
+    for(int i = 0; i < CLASS_PAGES_NUM; i++)
+    for(int j = 0; j < GLOBAL_SHARDS; j++)
+        ret |= cache_purge(&global_freeheap[n][i][j].top, PAGE_SZ_BY_IDX(i), ULONG_MAX, 1);
+
+    spin_unlock(&purge_lock);
+
+    /* Large allocations - Unmapped completely */
+    for(int i = 0; i < LARGE_CLASS_NUM; i++)
     {
-        /* Get the class information */
-        int page_num;
-        int class_idx = class_size_decode(sz, &page_num);
-        heap_t *bin = &thread_data.private_heap[class_idx];
+        void *block;
 
-        DEBUG_REAL_TOTAL_ALLOC(class_sizes[class_idx]);
+        while((block = stack_remove(&thread_data.large_top[i])))
+        {
+            munmap_wrap(block, LARGE_PAGES_BY_IDX(i));
+            ret = 1;
+        }
+
+        spin_lock(&global_large_lock[i]);
 
-        /* Traverse the pageblock list to find candidate for an allocation */
-        for(page_t *cur = bin->head; cur; cur = cur->next)
+        while((block = stack_remove(&global_large_freeheap[i])))
         {
-            void *ret = page_internal_alloc(cur);
-            if(ret) return ret;
+            ATOMIC_ADD(&global_large_cached, -(LARGE_PAGES_BY_IDX(i) * PAGE_SZ), __ATOMIC_RELAXED);
+            munmap_wrap(block, LARGE_PAGES_BY_IDX(i));
+            ret = 1;
         }
 
-        /* Allocate and initialize a pageblock */
-        void *alloc = get_pageblock(page_num);
+        spin_unlock(&global_large_lock[i]);
+    }
 
-        /* Failure */
-        if(!alloc) return NULL;
+    thread_data.large_cached = 0;
 
-        /* Initialize page and link to list */
-        page_t *page = page_internal_init(alloc, class_idx, page_num, thread_data.thread_id);
-        insert_front_dq(bin, page);
+    return ret;
+}
 
-        /* Allocate from the page and return */
-        return page_internal_alloc(page);
+/* Adds the counters and the cached pageblocks of a thread to the statistics - Registry lock is held */
+static void stats_collect(const thread_private_t *thread, xmalloc_stats_t *stats)
+{
+    for(int i = 0; i < CLASS_NUM; i++)
+    {
+        stats->classes[i].live_objects += thread->cache[i].allocs - thread->cache[i].frees;
+        stats->classes[i].pageblocks += thread->stats[i].pageblocks;
+        stats->classes[i].remote_frees += thread->stats[i].remote_frees;
+        stats->classes[i].steals += thread->stats[i].steals;
     }
 
-    /* Perform large allocation */
-    return large_alloc(sz);
+    stats->large_live_objects += thread->large_stats.allocs - thread->large_stats.frees;
+    stats->allocated += thread->large_stats.pages * PAGE_SZ;
+
+    /* Racy reads of the cache sizes - Good enough for statistics */
+    for(int i = 0; i < CLASS_PAGES_NUM; i++)
+        stats->cached += thread->top[i].count * PAGE_SZ_BY_IDX(i) * PAGE_SZ;
+
+    for(int i = 0; i < LARGE_CLASS_NUM; i++)
+        stats->cached += thread->large_top[i].count * LARGE_PAGES_BY_IDX(i) * PAGE_SZ;
 }
 
-void *calloc(size_t nmemb, size_t sz)
+/* Resident memory of the process - Raw reads, stdio allocates */
+static size_t resident_bytes(void)
 {
-    const size_t total_alloc = nmemb * sz;
+    char buf[128];
+    size_t field = 0, ret = 0;
+    int fd = open("/proc/self/statm", O_RDONLY);
 
-    /* Overflow found */
-    if (nmemb != 0 && total_alloc / nmemb != sz) return NULL;
+    if(fd < 0) return 0;
 
-    /* Call malloc and set to 0*/
-    void *ptr = malloc(total_alloc);
-    if(ptr) memset(ptr, 0, total_alloc);
+    const ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
 
-    return ptr;
+    /* Second field is the resident pages */
+    for(ssize_t i = 0; i < len && field < 2; i++)
+    {
+        if(buf[i] == ' ') field++;
+        else if(field == 1) ret = ret * 10 + (buf[i] - '0');
+    }
+
+    return ret * sysconf(_SC_PAGESIZE);
 }
 
-void *realloc(void *obj, size_t sz)
+/* Fills in the statistics of the allocator - Returns 0 on success */
+int xmalloc_stats_get(xmalloc_stats_t *stats)
 {
-    int page_offset;
-    size_t old_sz;
-    void *ret = obj;
+    const thread_busy_t busy;
 
-    /* 0 size is not supported */
-    if(!obj) return malloc(sz);
+    if(!stats) return -1;
 
-    DEBUG_COUNT_REALLOCS();
+    memset(stats, 0, sizeof(xmalloc_stats_t));
 
-    /* Find the type of object */
-    switch(object_type_decode(obj, &page_offset))
+    /* Forked children - Threads left behind do not count, what they held does */
+    fork_reclaim();
+
+    /* Live threads and then whatever the exited ones left behind */
+    spin_lock(&registry_lock);
+
+    for(const thread_private_t *cur = thread_registry; cur; cur = cur->reg_next)
     {
-        case CLASS_SMALL:
-        {
-            /* We also need to account for the header size */
-            old_sz = (GET_PAGE_START(obj, page_offset)->object_size) - sizeof(header_t);
-            break;
-        }
-        case CLASS_LARGE:
+        stats_collect(cur, stats);
+        stats->threads++;
+    }
+
+    for(int i = 0; i < CLASS_NUM; i++)
+    {
+        stats->classes[i].live_objects += exited_live[i];
+        stats->classes[i].pageblocks += exited_stats[i].pageblocks;
+        stats->classes[i].remote_frees += exited_stats[i].remote_frees;
+        stats->classes[i].steals += exited_stats[i].steals;
+    }
+
+    stats->large_live_objects += exited_large_stats.allocs - exited_large_stats.frees;
+    stats->allocated += exited_large_stats.pages * PAGE_SZ;
+
+    spin_unlock(&registry_lock);
+
+    /* Large allocations are in use as a whole */
+    stats->in_use = stats->allocated;
+
+    for(int i = 0; i < CLASS_NUM; i++)
+    {
+        int page_num;
+
+        class_size_decode(class_sizes[i] - 1, &page_num);
+
+        stats->classes[i].object_size = class_sizes[i];
+        stats->classes[i].pageblock_size = page_num * PAGE_SZ;
+        stats->allocated += stats->classes[i].live_objects * class_sizes[i];
+        stats->in_use += stats->classes[i].pageblocks * stats->classes[i].pageblock_size;
+    }
+
+    /* Global caches */
+    for(unsigned int n = 0; n < numa_nodes; n++)
+    for(int i = 0; i < CLASS_PAGES_NUM; i++)
+    for(int j = 0; j < GLOBAL_SHARDS; j++)
+        stats->cached += global_freeheap[n][i][j].top.count * PAGE_SZ_BY_IDX(i) * PAGE_SZ;
+
+    for(int i = 0; i < LARGE_CLASS_NUM; i++)
+        stats->cached += global_large_freeheap[i].count * LARGE_PAGES_BY_IDX(i) * PAGE_SZ;
+
+    stats->mapped = stats_mapped;
+    stats->resident = resident_bytes();
+
+    return 0;
+}
+
+/* Walks the live threads, the orphan pool and the global caches - How full each class is and where the free pageblocks
+ * are. Other threads are only read through their counters, their lists are theirs. Returns 0 on success */
+int xmalloc_heap_report(xmalloc_heap_report_t *report)
+{
+    const thread_busy_t busy;
+    long int live[CLASS_NUM] = {0}, cached[CLASS_NUM] = {0}, pageblocks[CLASS_NUM] = {0}, empty[CLASS_NUM] = {0};
+
+    if(!report) return -1;
+
+    memset(report, 0, sizeof(xmalloc_heap_report_t));
+
+    /* Forked children - Threads left behind do not count, what they held does */
+    fork_reclaim();
+
+    /* Live threads and then whatever the exited ones left behind - Racy reads of the cache sizes, good enough here */
+    spin_lock(&registry_lock);
+
+    for(const thread_private_t *cur = thread_registry; cur; cur = cur->reg_next)
+    {
+        for(int i = 0; i < CLASS_NUM; i++)
         {
-            old_sz = GET_LARGER_ALLOC_SZ(obj);
-            break;
+            live[i] += cur->cache[i].allocs - cur->cache[i].frees;
+            cached[i] += cur->cache[i].count;
+            pageblocks[i] += cur->stats[i].pageblocks;
+            empty[i] += cur->private_heap[i].empty_num;
         }
-        default: PANIC_ERR("Broken object, aborting [realloc]..\n");
+
+        for(int i = 0; i < CLASS_PAGES_NUM; i++)
+            report->cached_pageblocks[0][i] += cur->top[i].count;
+
+        report->threads++;
     }
 
-    /* If size is smaller simple return the same */
-    if(old_sz > sz) return ret;
+    for(int i = 0; i < CLASS_NUM; i++)
+    {
+        live[i] += exited_live[i];
+        pageblocks[i] += exited_stats[i].pageblocks;
+    }
 
-    /* Malloc - Copy - Free */
-    ret = malloc(sz);
+    spin_unlock(&registry_lock);
 
-    /* Move the allocation to the new block */
-    if(ret)
+#ifdef PERCPU_CACHE_ACTIVE
+    /* Objects in the caches of the CPUs are out of their pageblocks too */
+    if(percpu_caches)
     {
-        memcpy(ret, obj, old_sz);
-        free(obj);
+        for(unsigned int c = 0; c < percpu_cpus; c++)
+        for(int i = 0; i < CLASS_NUM; i++)
+            cached[i] += ((const pcache_t *)(percpu_caches + c * percpu_stride))[i].count;
     }
+#endif
 
-    return ret;
+    for(int i = 0; i < CLASS_NUM; i++)
+    {
+        xmalloc_heap_class_t *report_class = &report->classes[i];
+        int page_num;
+
+        class_size_decode(class_sizes[i] - 1, &page_num);
+
+        /* Orphans are pooled until someone takes them */
+        spin_lock(&orphan_lock[i]);
+
+        for(const page_t *cur = orphan_pool[i].head; cur; cur = cur->next)
+            report_class->orphaned_pageblocks++;
+
+        spin_unlock(&orphan_lock[i]);
+
+        report_class->object_size = class_sizes[i];
+        report_class->pageblock_size = page_num * PAGE_SZ;
+        report_class->pageblocks = (pageblocks[i] > 0) ? pageblocks[i] : 0;
+        report_class->capacity = report_class->pageblocks * ((page_num * PAGE_SZ - page_objects_off(page_num, class_sizes[i])) / class_sizes[i]);
+        report_class->live_objects = (live[i] > 0) ? live[i] : 0;
+        report_class->allocated_objects = report_class->live_objects + cached[i];
+        report_class->empty_pageblocks = (empty[i] > 0) ? empty[i] : 0;
+
+        /* Only an estimate, requested sizes are not kept - They are larger than the previous class, half of the step on average */
+        report_class->rounding_bytes_estimate = report_class->live_objects * (class_sizes[i] - (i ? class_sizes[i - 1] : 0) - 1) / 2;
+    }
+
+    /* Global caches and the retired pageblocks - The first page of a retired one stays resident, with its link */
+    for(int i = 0; i < CLASS_PAGES_NUM; i++)
+        report->pageblock_sizes[i] = PAGE_SZ_BY_IDX(i) * PAGE_SZ;
+
+    for(unsigned int n = 0; n < numa_nodes; n++)
+    for(int i = 0; i < CLASS_PAGES_NUM; i++)
+    for(int j = 0; j < GLOBAL_SHARDS; j++)
+        report->cached_pageblocks[1][i] += global_freeheap[n][i][j].top.count;
+
+    spin_lock(&retired_lock);
+
+    for(unsigned int n = 0; n < numa_nodes; n++)
+    for(int i = 0; i < CLASS_PAGES_NUM; i++)
+    for(void *cur = retired_heap[n][i]; cur; cur = *((void **)cur))
+        report->cached_pageblocks[2][i]++;
+
+    spin_unlock(&retired_lock);
+
+    return 0;
 }
 
-void free(void *obj)
+/* Heap report in the Prometheus text format - Only the classes in use are listed. Returns the length of the whole
+ * report as snprintf does, so that a larger buffer can be tried again, or -1 in case of failure */
+int xmalloc_heap_prometheus(char *buf, size_t size)
 {
-    int page_offset = 0;                            /* Page offset to reach start of page */
-    thread_private_t *local_data = &thread_data;    /* Thread local storage reference */
-    heap_t *local_heap;                             /* Local heap for classes */
+    static const char *const levels[XMALLOC_CACHE_LEVELS] = {"thread", "global", "retired"};
+    static const struct
+    {
+        const char *name, *help;
+        size_t offset;
+    }metrics[] =
+    {
+        {"pageblocks",              "Pageblocks in use",                               offsetof(xmalloc_heap_class_t, pageblocks)},
+        {"capacity_objects",        "Objects the pageblocks in use hold",              offsetof(xmalloc_heap_class_t, capacity)},
+        {"allocated_objects",       "Objects out of the pageblocks, cached ones too",  offsetof(xmalloc_heap_class_t, allocated_objects)},
+        {"live_objects",            "Objects handed out and not freed yet",            offsetof(xmalloc_heap_class_t, live_objects)},
+        {"empty_pageblocks",        "Empty pageblocks kept by their owners",           offsetof(xmalloc_heap_class_t, empty_pageblocks)},
+        {"orphaned_pageblocks",     "Pageblocks with live objects of exited threads",  offsetof(xmalloc_heap_class_t, orphaned_pageblocks)},
+        {"rounding_bytes_estimate", "Estimated bytes lost to class rounding",          offsetof(xmalloc_heap_class_t, rounding_bytes_estimate)},
+    };
+    xmalloc_heap_report_t report;
+    size_t len = 0;
+
+    if(xmalloc_heap_report(&report)) return -1;
+
+    /* Keeps counting once the buffer is full */
+    #define PROM_PRINT(...) (len += snprintf((len < size) ? buf + len : NULL, (len < size) ? size - len : 0, __VA_ARGS__))
+
+    PROM_PRINT("# HELP xmalloc_threads Live threads that used the allocator\n# TYPE xmalloc_threads gauge\n");
+    PROM_PRINT("xmalloc_threads %zu\n", report.threads);
+
+    for(unsigned int m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++)
+    {
+        PROM_PRINT("# HELP xmalloc_class_%s %s, per small object class\n# TYPE xmalloc_class_%s gauge\n",
+                   metrics[m].name, metrics[m].help, metrics[m].name);
 
-    /* Empty */
-    if(!obj) return;
+        for(int i = 0; i < CLASS_NUM; i++)
+        {
+            if(!report.classes[i].pageblocks && !report.classes[i].live_objects) continue;
 
-    DEBUG_COUNT_FREES();
+            PROM_PRINT("xmalloc_class_%s{size=\"%zu\"} %zu\n", metrics[m].name, report.classes[i].object_size,
+                       *(const size_t *)((const char *)&report.classes[i] + metrics[m].offset));
+        }
+    }
 
-    /* Find the type of object */
-    switch(object_type_decode(obj, &page_offset))
+    PROM_PRINT("# HELP xmalloc_cached_pageblocks Free pageblocks in the caches\n# TYPE xmalloc_cached_pageblocks gauge\n");
+
+    for(int l = 0; l < XMALLOC_CACHE_LEVELS; l++)
+    for(int i = 0; i < XMALLOC_PAGE_CLASSES; i++)
     {
-        case CLASS_SMALL: break; /* Handle below */
-        case CLASS_LARGE: large_free(obj); return;
-        default: PANIC_ERR("Broken object, aborting..[free]\n");
+        PROM_PRINT("xmalloc_cached_pageblocks{level=\"%s\",pageblock_size=\"%zu\"} %zu\n", levels[l],
+                   report.pageblock_sizes[i], report.cached_pageblocks[l][i]);
     }
 
-    /* Get the start of the pageblock */
-    page_t *page = GET_PAGE_START(obj, page_offset);
+    #undef PROM_PRINT
 
-    /* Get the local heap by the class size */
-    local_heap = &local_data->private_heap[class_size_decode(page->object_size - 1, &page_offset)];
+    return (len > INT_MAX) ? -1 : (int)len;
+}
+
+/* Large allocation of the malloc family - Counted towards the next sample */
+static void *large_alloc_sampled(const size_t sz, const int zero)
+{
+    void *ret = large_alloc(sz, zero);
+    if(ret && prof_due(sz)) prof_sample_large(ret, sz);
 
-    /* Free object */
-    page_internal_free(local_heap, page, (char *)obj, local_data->thread_id);
+    return ret;
 }
 
-void *operator new(std::size_t count)
+/* Takes a sample if enough bytes went through the allocator - Nothing to do unless profiling is on */
+static inline int prof_due(const size_t bytes)
 {
-    return malloc(count);
+    if(!prof_interval) return 0;
+
+    thread_data.prof_left -= bytes;
+
+    return thread_data.prof_left < 0 && !thread_data.prof_busy;
 }
 
-void *operator new[](std::size_t count)
+/* Replaces a small object with a sampled large one, aligned at a page for the aligned requests.
+ * The small object goes back to the thread cache. */
+static void *prof_sample_small(tcache_t *cache, void *obj, const size_t sz, const int zero)
 {
-    return malloc(count);
+    const thread_busy_t busy;
+
+    /* Next time then */
+    if(cache->count >= cache->depth) return obj;
+
+    thread_data.prof_busy = 1;
+    void *ret = large_aligned_alloc(sz ? sz : 1, PAGE_SZ);
+    thread_data.prof_busy = 0;
+
+    if(!ret) return obj;
+
+    /* Cached blocks hold old data */
+    if(zero) memset(ret, 0, sz);
+
+    cache->objects[cache->count++] = FREE_CHECK_CACHE_IN(obj);
+    cache->allocs--;
+
+    prof_sample_large(ret, sz);
+
+    return ret;
 }
 
-void *operator new(std::size_t count, const std::nothrow_t &tag)
+/* Marks and records a sample and picks the next interval - Uniform around the configured one */
+static void prof_sample_large(void *obj, const size_t sz)
 {
-    return malloc(count);
+    thread_private_t *local_data = &thread_data;
+
+    local_data->prof_seed = local_data->prof_seed * 1103515245U + 12345U;
+    local_data->prof_left = (long int)(((unsigned long int)(local_data->prof_seed >> 8) * 2 * prof_interval) >> 24);
+
+    local_data->prof_busy = 1;
+    LARGE_SAMPLED(obj) = 1;
+    prof_record(obj, sz);
+    local_data->prof_busy = 0;
 }
 
-void *operator new[](std::size_t count, const std::nothrow_t &tag)
+/* Unwinder state - Our own frames are skipped */
+typedef struct
 {
-    return malloc(count);
+    void **stack;
+    unsigned int depth, skip;
+}prof_trace_t;
+
+static _Unwind_Reason_Code prof_unwind(struct _Unwind_Context *context, void *arg)
+{
+    prof_trace_t *trace = (prof_trace_t *)arg;
+
+    if(trace->skip)
+    {
+        trace->skip--;
+        return _URC_NO_REASON;
+    }
+
+    const uintptr_t ip = _Unwind_GetIP(context);
+
+    if(!ip || trace->depth == PROF_DEPTH) return _URC_END_OF_STACK;
+
+    trace->stack[trace->depth++] = (void *)ip;
+
+    return _URC_NO_REASON;
 }
 
-void operator delete(void *ptr)
+/* Sampled objects are page aligned */
+static inline unsigned int prof_hash(const void *obj)
 {
-    free(ptr);
+    return (unsigned int)(((uintptr_t)obj >> PAGE_BITS) & (PROF_BUCKETS - 1));
 }
 
-void operator delete[](void *ptr)
+/* Keeps the stack of a sampled object - Entries come from raw pages, never from malloc */
+static void prof_record(void *obj, const size_t sz)
 {
-    free(ptr);
+    void *stack[PROF_DEPTH];
+    prof_trace_t trace = {stack, 0, 2};
+
+    _Unwind_Backtrace(prof_unwind, &trace);
+
+    spin_lock(&prof_lock);
+
+    if(!prof_unused)
+    {
+        prof_sample_t *chunk = (prof_sample_t *)mmap_wrap(PROF_CHUNK_PAGES);
+
+        if(!chunk)
+        {
+            spin_unlock(&prof_lock);
+            LARGE_SAMPLED(obj) = 0;
+            return;
+        }
+
+        for(size_t i = 0; i < PROF_CHUNK_PAGES * PAGE_SZ / sizeof(prof_sample_t); i++)
+        {
+            chunk[i].next = prof_unused;
+            prof_unused = &chunk[i];
+        }
+    }
+
+    prof_sample_t *sample = prof_unused;
+    prof_unused = sample->next;
+
+    sample->obj = obj;
+    sample->size = sz;
+    sample->depth = trace.depth;
+    memcpy(sample->stack, stack, trace.depth * sizeof(void *));
+
+    const unsigned int bucket = prof_hash(obj);
+    sample->next = prof_table[bucket];
+    prof_table[bucket] = sample;
+
+    prof_total_samples++;
+    prof_total_bytes += sz;
+
+    spin_unlock(&prof_lock);
 }
 
-void operator delete(void *ptr, const std::nothrow_t &tag)
+/* Unlinks the sample of an object - Lock is held */
+static prof_sample_t *prof_unlink(const void *obj)
 {
-    free(ptr);
+    prof_sample_t **link = &prof_table[prof_hash(obj)];
+
+    for(; *link; link = &(*link)->next)
+    {
+        prof_sample_t *sample = *link;
+
+        if(sample->obj != obj) continue;
+
+        *link = sample->next;
+        prof_total_samples--;
+        prof_total_bytes -= sample->size;
+
+        return sample;
+    }
+
+    return NULL;
 }
 
-void operator delete[](void* ptr, const std::nothrow_t &tag)
+static void prof_remove(const void *obj)
 {
-    free(ptr);
+    spin_lock(&prof_lock);
+
+    prof_sample_t *sample = prof_unlink(obj);
+
+    if(sample)
+    {
+        sample->next = prof_unused;
+        prof_unused = sample;
+    }
+
+    spin_unlock(&prof_lock);
 }
 
-void operator delete(void *ptr, std::size_t sz)
+/* Reallocated sample - Same stack, new place and size */
+static void prof_move(const void *old_obj, void *new_obj, const size_t sz)
 {
-    free(ptr);
+    spin_lock(&prof_lock);
+
+    prof_sample_t *sample = prof_unlink(old_obj);
+
+    if(sample)
+    {
+        const unsigned int bucket = prof_hash(new_obj);
+
+        sample->obj = new_obj;
+        sample->size = sz;
+        sample->next = prof_table[bucket];
+        prof_table[bucket] = sample;
+
+        prof_total_samples++;
+        prof_total_bytes += sz;
+    }
+
+    spin_unlock(&prof_lock);
 }
 
-void operator delete[](void *ptr, std::size_t sz)
+/* Writes it all or fails */
+static int prof_write(const int fd, const char *buf, size_t len)
 {
-    free(ptr);
+    while(len)
+    {
+        const ssize_t done = write(fd, buf, len);
+
+        if(done < 0)
+        {
+            if(errno == EINTR) continue;
+            return -1;
+        }
+
+        buf += done;
+        len -= done;
+    }
+
+    return 0;
+}
+
+/* Writes the live samples in the legacy heap profile format of pprof, followed by the mappings of the process.
+ * Calls nothing that allocates. Returns 0 on success and -1 if profiling is off or the file cannot be written. */
+int xmalloc_prof_dump(const char *path)
+{
+    char buf[8192];
+    size_t len;
+    int ret = 0;
+
+    if(!prof_interval || !path) return -1;
+
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return -1;
+
+    /* A single pass under the lock - Sampling threads wait for the dump */
+    spin_lock(&prof_lock);
+
+    len = snprintf(buf, sizeof(buf), "heap profile: %ld: %ld [%ld: %ld] @ heap_v2/%ld\n", prof_total_samples, prof_total_bytes,
+                                                                                          prof_total_samples, prof_total_bytes, prof_interval);
+
+    for(int i = 0; i < PROF_BUCKETS && !ret; i++)
+    for(const prof_sample_t *sample = prof_table[i]; sample && !ret; sample = sample->next)
+    {
+        /* Room for a whole entry */
+        if(sizeof(buf) - len < 64 + PROF_DEPTH * 20)
+        {
+            ret = prof_write(fd, buf, len);
+            len = 0;
+        }
+
+        len += snprintf(buf + len, sizeof(buf) - len, "1: %zu [1: %zu] @", sample->size, sample->size);
+
+        for(unsigned int j = 0; j < sample->depth; j++)
+            len += snprintf(buf + len, sizeof(buf) - len, " %p", sample->stack[j]);
+
+        buf[len++] = '\n';
+    }
+
+    spin_unlock(&prof_lock);
+
+    /* The mappings resolve the addresses */
+    if(!ret) ret = prof_write(fd, buf, len);
+
+    const char maps_title[] = "\nMAPPED_LIBRARIES:\n";
+    if(!ret) ret = prof_write(fd, maps_title, sizeof(maps_title) - 1);
+
+    const int maps_fd = open("/proc/self/maps", O_RDONLY);
+    ssize_t maps_len;
+
+    if(maps_fd < 0) ret = -1;
+
+    while(!ret && (maps_len = read(maps_fd, buf, sizeof(buf))) > 0)
+        ret = prof_write(fd, buf, maps_len);
+
+    if(maps_fd >= 0) close(maps_fd);
+    close(fd);
+
+    return ret;
 }
 
 void malloc_debug_stats(void)
@@ -792,22 +3670,28 @@ void malloc_debug_stats(void)
     {
         heap_t *bin = &local_data->private_heap[i];
 
-        if(!bin->head)
+        if(!bin->avail.head && !bin->full.head && !bin->empty.head)
         {
             // printf(" (NULL)\n");
             continue;
         }
 
-        int counter = 0, total_objects = 0;
+        int counter = 0, total_objects = 0, parked = 0;
 
-        /* Traverse the pageblock list to find candidate for an allocation */
-        for(cur = bin->head; cur; cur = cur->next)
+        /* Traverse the pageblock lists */
+        for(cur = bin->avail.head; cur; cur = cur->next)
         {
             counter++;
             total_objects += cur->allocated_objects;
         }
 
-        printf("object size: %d:: Blocks %d - Total objects %d\n", class_sizes[i], counter, total_objects);
+        for(cur = bin->full.head; cur; cur = cur->next)
+        {
+            parked++;
+            total_objects += cur->allocated_objects;
+        }
+
+        printf("object size: %d:: Blocks %d - Full blocks %d - Empty blocks %u - Total objects %d\n", class_sizes[i], counter, parked, bin->empty_num, total_objects);
 //        fflush(stdout);
     }
 
@@ -14,11 +14,87 @@
 
 _BEGIN_DECLS_
 
+/* Number of small object classes reported */
+#define XMALLOC_STATS_CLASSES 64
+
+/* Statistics of a small object class */
+typedef struct xmalloc_class_stats
+{
+    size_t object_size;         /* Size of the objects, 1-byte header included */
+    size_t pageblock_size;      /* Size of the pageblocks of the class */
+    size_t live_objects;        /* Objects handed out and not freed yet */
+    size_t pageblocks;          /* Pageblocks in use - Owned by threads or orphaned */
+    size_t remote_frees;        /* Objects freed by a thread other than the owner of their pageblock */
+    size_t steals;              /* Orphaned pageblocks adopted by other threads */
+}xmalloc_class_stats_t;
+
+/* Statistics of the whole allocator */
+typedef struct xmalloc_stats
+{
+    size_t mapped;              /* Bytes mapped from the OS */
+    size_t resident;            /* Resident bytes of the whole process */
+    size_t cached;              /* Bytes of free pageblocks and large allocations kept in the caches */
+    size_t allocated;           /* Bytes handed out, rounded up to the class or page size */
+    size_t in_use;              /* Bytes of the pageblocks in use and of the large allocations */
+    size_t large_live_objects;  /* Large allocations not freed yet */
+    size_t threads;             /* Live threads that used the allocator */
+    xmalloc_class_stats_t classes[XMALLOC_STATS_CLASSES];
+}xmalloc_stats_t;
+
+/* Pageblock cache levels and sizes reported - Thread caches, global caches and pageblocks retired in the arenas */
+#define XMALLOC_CACHE_LEVELS    3
+#define XMALLOC_PAGE_CLASSES    3
+
+/* Heap report of a small object class - Utilization is allocated_objects / capacity */
+typedef struct xmalloc_heap_class
+{
+    size_t object_size;         /* Size of the objects, 1-byte header included */
+    size_t pageblock_size;      /* Size of the pageblocks of the class */
+    size_t pageblocks;          /* Pageblocks in use - Owned by threads or orphaned */
+    size_t capacity;            /* Objects the pageblocks in use hold */
+    size_t allocated_objects;   /* Objects out of the pageblocks - Live ones and the ones in the object caches */
+    size_t live_objects;        /* Objects handed out and not freed yet */
+    size_t empty_pageblocks;    /* Pageblocks without live objects that their owners keep for reuse */
+    size_t orphaned_pageblocks; /* Pageblocks with live objects left by exited threads, until adopted or stolen */
+    size_t rounding_bytes_estimate; /* Estimate, not measured: bytes of the live objects lost to the class rounding, assuming
+                                     * requests spread evenly between the previous class and this one. Requested sizes are
+                                     * not kept, so the actual loss can be anywhere from 0 to the whole step per object */
+}xmalloc_heap_class_t;
+
+/* Heap report of the whole allocator - Walks the live threads and the global caches */
+typedef struct xmalloc_heap_report
+{
+    size_t threads;                                                         /* Live threads that used the allocator */
+    size_t pageblock_sizes[XMALLOC_PAGE_CLASSES];                           /* Sizes of the cached pageblocks */
+    size_t cached_pageblocks[XMALLOC_CACHE_LEVELS][XMALLOC_PAGE_CLASSES];   /* Free pageblocks of each size per level */
+    xmalloc_heap_class_t classes[XMALLOC_STATS_CLASSES];
+}xmalloc_heap_report_t;
+
+/* Flags of malloc_ex */
+#define XMALLOC_CACHE_LINE  0x1     /* Cache line aligned and padded to whole lines - No false sharing with other objects */
+
 /* External routines */
 void *malloc(size_t sz);
 void *calloc(size_t nmemb, size_t sz);
 void *realloc(void *obj, size_t sz);
 void free(void *obj);
+int posix_memalign(void **memptr, size_t alignment, size_t sz);
+void *aligned_alloc(size_t alignment, size_t sz);
+void *memalign(size_t alignment, size_t sz);
+void *valloc(size_t sz);
+void *pvalloc(size_t sz);
+void *malloc_ex(size_t sz, int flags);
+void free_sized(void *obj, size_t sz);
+void free_aligned_sized(void *obj, size_t alignment, size_t sz);
+size_t malloc_batch(size_t sz, void **ptrs, size_t num);
+void free_batch(void **ptrs, size_t num);
+size_t malloc_usable_size(void *obj);
+int malloc_trim(size_t pad);
+int xmalloc_handoff(void *obj);
+int xmalloc_stats_get(xmalloc_stats_t *stats);
+int xmalloc_heap_report(xmalloc_heap_report_t *report);
+int xmalloc_heap_prometheus(char *buf, size_t size);
+int xmalloc_prof_dump(const char *path);
 void malloc_debug_stats(void);
 
 _END_DECLS_
@@ -26,6 +26,19 @@
 //#define HEADER_VALIDATION_ACTIVE
 //#define HEADER_ATOMIC_STORE_ACTIVE
 
+/* Activates headerless small objects - Their pageblock is found through the page map of its arena, so classes hold
+ * requests of their full size. Large allocations keep their header */
+//#define HEADERLESS_ACTIVE
+
+/* Bytes in front of each small object and the request size class_size_decode() maps to the class that fits it */
+#ifdef HEADERLESS_ACTIVE
+    #define SMALL_HEADER_SIZE       0
+#else
+    #define SMALL_HEADER_SIZE       sizeof(header_t)
+#endif
+
+#define SMALL_CLASS_REQUEST(sz)     ((sz) + SMALL_HEADER_SIZE - 1)
+
 /* Verification in case of changes */
 #if !((HEADER_TOTAL_BITS) > (HEADER_PAGE_OFF_BITS))
     #error Header is not 1 byte!!!
@@ -44,10 +57,12 @@
 #define HEADER_VALID_MASK       (GEN_MASK(HEADER_SECURITY_BITS))
 #define HEADER_VALID            (SECURITY_OPCODE & HEADER_VALID_MASK)
 
-/* Large allocation header manipulation */
+/* Large allocation header manipulation - The header is right before the payload, which is at the start
+ * of the block plus the header, or on the second page for aligned allocations (the block is still page aligned) */
 #define LARGE_HEADER_SIZE               16
-#define GET_LARGER_ALLOC_START(obj)     ((void *)(((char *) obj) - LARGE_HEADER_SIZE))
+#define GET_LARGER_ALLOC_START(obj)     ((void *)GET_PAGE_BOUNDARY(((char *) obj) - LARGE_HEADER_SIZE))
 #define GET_LARGER_ALLOC_SZ(obj)        (*((size_t *)(((char *) obj) - LARGE_HEADER_SIZE)))
+#define LARGE_SAMPLED(obj)              (*(((char *) obj) - 2))     /* Set if the heap profiler keeps a sample of it */
 
 /* Macros for small header manipulation */
 #define GET_HEADER(ptr)             (*(((char *) (ptr)) - 1))
@@ -60,12 +75,12 @@
     /* Atomically write header */
     #define WRITE_HEADER(ptr, header)            \
             do{                                         \
-                ATOMIC_STORE((ptr), (header));          \
+                ATOMIC_STORE((ptr), (header), __ATOMIC_RELEASE);          \
             }while(0)
 
     #define WRITE_LARGE_HEADER_SZ(ptr, sz)       \
             do{                                         \
-                ATOMIC_STORE((ptr), (sz));              \
+                ATOMIC_STORE((ptr), (sz), __ATOMIC_RELEASE);              \
             }while(0)
 #else
     /* Non-atomic writes */
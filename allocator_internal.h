@@ -10,9 +10,20 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <unistd.h>
+#include <errno.h>
 
 /* Kernel mmap/munmap */
 #include <sys/mman.h>
+#include <time.h>
+
+/* NUMA node discovery and memory binding - Raw system calls, no libnuma */
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+/* Fork handlers */
+#include <pthread.h>
 
 /* Atomic operations */
 #include "atomic.h"
@@ -22,16 +33,66 @@
 #define CLASS_LARGE         1
 #define CLASS_NUM           64
 
+/* Class lookup table - An entry per 16 bytes of request up to the small limit, | Range (2 bits) | Class (6 bits) | */
+#define CLASS_LUT_SIZE          ((SMALL_ALLOCATION_LIMIT >> 4) + 1)
+#define CLASS_LUT_RANGE_SHIFT   6
+
 /* Page information */
 #define CLASS_PAGES_NUM         3
 #define PAGE_BITS               12
 #define PAGE_SZ                 (1 << PAGE_BITS)        /* Default page size 4KB */
-#define PAGE_MULTIPLIER         3                       /* 2^Multiplier * [1, 2, 4] * PAGE_SZ */
+#define PAGE_MULTIPLIER         3                       /* 2^Multiplier * [1, 2, 4] * PAGE_SZ - The largest one XMALLOC_CONF can pick */
 #define SMALL_ALLOCATION_LIMIT  (PAGE_SZ/2)             /* Small allocation limit is half a page below */
 
+/* Huge page information - Arenas are advised for huge pages in hugepage mode */
+#define HUGE_PAGE_BITS          21
+#define HUGE_PAGE_SZ            (1UL << HUGE_PAGE_BITS) /* Default (transparent) huge page size 2MB */
+
+/* Arena information - Pageblocks are carved out of large reserved regions */
+#define ARENA_BITS              26
+#define ARENA_SZ                (1UL << ARENA_BITS)     /* Arena size 64MB, arenas are also aligned at it */
+#define ARENA_PAGES             (ARENA_SZ >> PAGE_BITS)
+#define ARENA_MAP_PAGES         (ARENA_PAGES / PAGE_SZ)  /* Headerless mode - Page map at the start of each arena, 1 byte per page */
+#define ARENA_SLOTS             (1UL << (47 - ARENA_BITS)) /* Arena aligned slots of the user address space */
+
+/* NUMA information - Nodes above the limit share the caches of node 0 */
+#define NUMA_NODES_MAX          8
+
+/* Global pageblock caches - Shards per node and size, a thread uses the one of its CPU first */
+#define GLOBAL_SHARDS           4
+
+/* Local pageblock caches - Pageblocks kept per size in each thread, the rest go to the global caches. Only their thread
+ * purges them, so an idle thread pins at most this many */
+#define LOCAL_CACHE_DEPTH       8
+
+/* Empty pageblocks kept per class - Once there are twice as many, the oldest go back to the caches down to this */
+#define EMPTY_PAGEBLOCKS    2
+
+/* Thread cache - Most objects kept per class, half of the configured depth moves from/to the pageblocks at once */
+#define TCACHE_DEPTH        32
+#define REMOTE_CHAINS       4       /* Destination pageblocks of remote frees chained at once while draining */
+
+/* Large allocations cache - Up to LARGE_CACHE_MAX_PAGES they are binned and cached, above they go directly to the kernel */
+#define LARGE_CLASS_NUM         28
+#define LARGE_CACHE_MAX_PAGES   256                     /* 1MB */
+#define LARGE_LOCAL_CACHE_SZ    (4UL << 20)             /* Bytes kept over all the bins of each thread */
+#define LARGE_GLOBAL_CACHE_SZ   (32UL << 20)            /* Bytes kept over all the global bins */
+
+/* Purging of idle cached pageblocks - Decay time before their memory goes back to the OS and passes per decay period */
+#define PURGE_DECAY_MS      10000
+#define PURGE_TICKS         4
+
+/* Heap profiling - Frames kept per sample, buckets of the samples table and pages of each chunk of samples */
+#define PROF_DEPTH          32
+#define PROF_BUCKETS        4096
+#define PROF_CHUNK_PAGES    16
+
 /* Minimum alignment requirement */
 #define DEFAULT_ALLIGN     0x10
 
+/* Cache line size - Line aligned allocations are padded to it */
+#define CACHE_LINE_SZ      64
+
 /* Mmap system call flags */
 #define MMAP_PROT_ARGS  (PROT_READ | PROT_WRITE)
 #define MMAP_FLAGS_ARGS  (MAP_ANONYMOUS | MAP_PRIVATE)
@@ -43,8 +104,11 @@
 #define GET_PAGE_NUM(x)         (((x) >> PAGE_BITS) + (!!((x) & ALIGN_MASK(PAGE_SZ))))
 
 /* Manipulating page classes by index and size */
-#define PAGE_SZ_BY_IDX(x)       (1 << ((x) + PAGE_MULTIPLIER))
-#define IDX_BY_PAGE_SZ(x)       (LOG2((unsigned int)((x) >> PAGE_MULTIPLIER)))
+#define PAGE_SZ_BY_IDX(x)       (1 << ((x) + page_multiplier))                         /* Multiplier of the runtime configuration */
+#define IDX_BY_PAGE_SZ(x)       (LOG2((unsigned int)((x) >> page_multiplier)))
+
+/* Large bins page sizes by index - Exact up to 8 pages, then 4 bins per power of two */
+#define LARGE_PAGES_BY_IDX(x)   ((x) < 8 ? (x) + 1 : (((((x) - 8) & 3) + 5) << ((((x) - 8) >> 2) + 1)))
 
 /* Fast implementation of log2 for integers */
 #define LOG2(x) ((unsigned int) (8 * sizeof(unsigned int) - __builtin_clz((x)) - 1))
@@ -52,14 +116,30 @@
 /* Tests if an integer is a power of 2 */
 #define IS_POWER_OF_TWO(x) (((x) & ((x) - 1)) == 0)
 
+/* Largest power of 2 that divides an integer */
+#define LOWEST_POWER_OF_TWO(x) ((x) & -(x))
+
 /* rfid struct parameters - Check below */
 #define REMOTELY_FREED_OFFSET_BITS       24
 #define REMOTELY_FREED_COUNT_BITS        16
-#define THREAD_ID_BITS                   24
+#define PAGE_STATE_BITS                  2
+#define THREAD_ID_BITS                   22
 
 /* The thread "ID" of an orphaned pageblock */
 #define ORPHAN_ID           ((1 << THREAD_ID_BITS) - 1)
 
+/* IDs of exited threads kept for reuse - Any more are lost */
+#define THREAD_IDS_RECYCLED 4096
+
+/* Pageblock states, kept next to the remote LIFO so remote frees see them in the same CAS:
+ * - NONE: The pageblock is in the available list of its owner (or orphaned), nothing to do.
+ * - PARKED: The owner moved the exhausted pageblock in its full list, the next remote free
+ *           has to notify the owner that the pageblock has objects again.
+ * - NOTIFYING: A remote free is pushing the pageblock in the notification stack of the owner. */
+#define PAGE_STATE_NONE         0
+#define PAGE_STATE_PARKED       1
+#define PAGE_STATE_NOTIFYING    2
+
 /* These numbers are for the rfid struct and depend mainly on the page multiplier and the header size.
  * So the page sizes(in bytes) go as follows:
  *
@@ -77,6 +157,9 @@
  * is the first object sub-class of 16-bytes.
  * So, the division yields 2^17/2^4 = 2^13 maximum objects (this is an upper bound so we are covered)
  *
+ * For the state:
+ * 2 bits for the pageblock states above.
+ *
  * For the thread_id:
  * We use whatever is left and try to have at least 1000000 < IDs.
  */
@@ -84,17 +167,58 @@
 /* A character is (1 byte), the size of our header */
 typedef char header_t;
 
-/* Heap that holds an object class - A doubly linked list with head and tail */
-typedef struct private_heap_struct
+/* A doubly linked list of pageblocks with head and tail */
+typedef struct page_list_struct
 {
     struct pageblock_struct *head, *tail;
+}page_list_t;
+
+/* Heap that holds an object class - Pageblocks with space and exhausted pageblocks are kept apart */
+typedef struct private_heap_struct
+{
+    page_list_t avail;                  /* Pageblocks we can allocate from */
+    page_list_t full;                   /* Exhausted pageblocks - Revisited only when objects are freed */
+    page_list_t empty;                  /* Pageblocks with no live objects, most recent first - Reused before new ones */
+    unsigned int empty_num;             /* Pageblocks in the empty list */
 }heap_t;
 
+/* Thread cache of a class - A LIFO of objects ready to be handed out */
+typedef struct object_cache_struct
+{
+    unsigned int count;                 /* Objects in the cache */
+    unsigned int depth;                 /* Objects it holds before a batch is drained - Up to TCACHE_DEPTH */
+    long int allocs, frees;             /* Objects handed out and taken back - Statistics */
+    void *objects[TCACHE_DEPTH];        /* Top of the LIFO is objects[count - 1] */
+}tcache_t;
+
+/* Per-CPU cache of a class - Only changed by restartable sequences on its CPU, whose last store is the count */
+typedef struct percpu_cache_struct
+{
+    unsigned long int count;            /* Objects in the cache */
+    void *objects[TCACHE_DEPTH];        /* Top of the LIFO is objects[count - 1] */
+}pcache_t;
+
+/* Per-thread statistics of a class - Summed over all threads on demand, so a single thread can go negative */
+typedef struct class_stats_struct
+{
+    long int pageblocks;                /* Pageblocks taken minus pageblocks released */
+    long int remote_frees;              /* Objects freed in pageblocks of other threads */
+    long int steals;                    /* Orphaned pageblocks adopted */
+}class_stats_t;
+
+/* Per-thread statistics of the large allocations */
+typedef struct large_stats_struct
+{
+    long int allocs, frees;             /* Objects handed out and taken back */
+    long int pages;                     /* Pages handed out minus pages taken back */
+}large_stats_t;
+
 /* Remotely freed list and thread ID */
 typedef struct shared_rfid_struct
 {
     unsigned long int count: REMOTELY_FREED_COUNT_BITS;            /* Count is the most objects we can have in a pageblock */
     unsigned long int remotely_freed: REMOTELY_FREED_OFFSET_BITS;  /* Offset maximum is 2^(Multiplier + 14) */
+    unsigned long int state: PAGE_STATE_BITS;                      /* Full list notification state */
     unsigned long int thread_id: THREAD_ID_BITS;                   /* Thread ID is limited */
 }rfid;
 
@@ -105,7 +229,8 @@ typedef union rfid_union
     unsigned long int both;                /* Merged representation - For cmp & swap */
 }rfid_un;
 
-/* Pageblock for the object classes */
+/* Pageblock for the object classes - The header takes two cache lines. The first one is written by the owning thread
+ * only, the second one by remote frees, so that they do not invalidate what the owner allocates from. */
 typedef struct pageblock_struct
 {
     /* Management info */
@@ -117,9 +242,71 @@ typedef struct pageblock_struct
     /* Local memory requests */
     unsigned int unallocated_off;              /* Unallocated objects offset start */
     unsigned int freed;                        /* Local frees - Owning thread */
+    unsigned char parked;                      /* Pageblock is in the full list - Owning thread */
+    unsigned char pooled;                      /* Orphaned pageblock in the orphan pool - Under the pool lock */
+    unsigned char node;                        /* NUMA node of the arena it was carved from - Never changes */
+    unsigned int zeroed_off;                   /* Memory from this offset on was never written - Owning thread */
+    struct pageblock_struct *volatile *notify; /* Notification stack of the owner */
+
+    /* ID and Rf list - Starts the shared line */
+    volatile rfid_un sync __attribute__((aligned(CACHE_LINE_SZ)));   /* Collective data that are in sync via cmp & swap */
+    unsigned char class_idx;                   /* Class of the objects - Read by every free, never changes while in use */
 
-    /* ID and Rf list */
-    volatile rfid_un sync;                     /* Collective data that are in sync via cmp & swap */
+    /* Full list notifications - Cached pageblocks keep the time they were cached at instead */
+    union
+    {
+        struct pageblock_struct *notify_next;               /* Link in the notification stack - Written by the remote free */
+        unsigned long int cached_time;                      /* Caching time in ms, 0 when there is nothing to purge */
+    };
 }page_t;
 
+/* Activates double free checks - A bitmap after the header of each pageblock has a bit per 16 bytes of it, set while the object
+ * that starts there is in a thread or per-CPU cache or in the freed LIFO. Freeing an object whose bit is set aborts. Caches
+ * hold objects of any pageblock, so the words are shared with other threads and changed atomically */
+//#define FREE_CHECK_ACTIVE
+
+#ifdef FREE_CHECK_ACTIVE
+    #define FREE_MAP_BITS               4       /* Bytes per bit - Objects are at least 16 bytes apart */
+    #define FREE_MAP_SIZE(page_num)     ((page_num) * (PAGE_SZ >> (FREE_MAP_BITS + 3)))
+    #define FREE_MAP(page)              ((unsigned long int *)(((char *)(page)) + sizeof(page_t)))
+    #define FREE_MAP_WORD(page, off)    (FREE_MAP(page)[(off) >> (FREE_MAP_BITS + 6)])
+    #define FREE_MAP_BIT(off)           (1UL << (((off) >> FREE_MAP_BITS) & 63))
+    #define FREE_MAP_TEST(page, off)    (FREE_MAP_WORD((page), (off)) & FREE_MAP_BIT((off)))
+
+    /* Freed objects must not be free already - Set and tested at once */
+    #define FREE_MAP_PUSH(page, off)                                                        \
+        do                                                                                  \
+        {                                                                                   \
+            if(ATOMIC_OR(&FREE_MAP_WORD((page), (off)), FREE_MAP_BIT((off)), __ATOMIC_RELAXED) & FREE_MAP_BIT((off))) \
+                free_check_abort();                                                         \
+        }while(0)
+
+    /* Refilled objects were just allocated, nothing to test */
+    #define FREE_MAP_SET(page, off)     ATOMIC_OR(&FREE_MAP_WORD((page), (off)), FREE_MAP_BIT((off)), __ATOMIC_RELAXED)
+    #define FREE_MAP_POP(page, off)     ATOMIC_AND(&FREE_MAP_WORD((page), (off)), ~FREE_MAP_BIT((off)), __ATOMIC_RELAXED)
+#else
+    #define FREE_MAP_SIZE(page_num)     0
+    #define FREE_MAP_PUSH(page, off)
+    #define FREE_MAP_SET(page, off)
+    #define FREE_MAP_POP(page, off)
+#endif
+
+/* Reads the sync word of a pageblock once no remote free is notifying its owner - Acquires what that one wrote */
+#define PAGE_SYNC_SETTLED(page, head)                                                       \
+    do                                                                                      \
+    {                                                                                       \
+        (head).both = ATOMIC_LOAD(&(page)->sync.both, __ATOMIC_ACQUIRE);                   \
+        if((head).shared.state != PAGE_STATE_NOTIFYING) break;                              \
+        CPU_RELAX();                                                                        \
+    }while(1)
+
+/* Remote frees to the same pageblock - Linked through their remote LIFO fields, pushed with a single CAS */
+typedef struct remote_chain_struct
+{
+    page_t *page;                       /* Destination pageblock */
+    char *tail;                         /* First object chained - Gets linked to the remote LIFO of the pageblock */
+    unsigned int head_off;              /* Last object chained - The new head of the remote LIFO */
+    unsigned int count;                 /* Objects in the chain */
+}remote_chain_t;
+
 #endif
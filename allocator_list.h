@@ -33,8 +33,14 @@
  * */
 
 /* Virtual addresses info, base modifier is the effective bits count
- * This should be a multiple of 2. */
-#define VIRTUAL_EFFECTIVE_BITS  (52)
+ * This should be a multiple of 2. Per architecture, it has to cover every user space address:
+ * - x86-64: 47 bits, or 56 with 5-level paging (only for mappings hinted above 47 bits, we never hint).
+ * - aarch64: 48 bits, or 52 with large virtual addresses. Pointers are never tagged by us. */
+#if defined(__x86_64__) || defined(__aarch64__)
+    #define VIRTUAL_EFFECTIVE_BITS  (52)
+#else
+    #error "Unsupported architecture - Only x86-64 and aarch64 are supported"
+#endif
 #define VIRTUAL_UNUSED_BITS     (64 - VIRTUAL_EFFECTIVE_BITS)
 
 /* Queue count, state and pointer manipulation */
@@ -84,11 +90,11 @@ static inline int stack_is_full(dq_ct_node *stack_top)
 
 /************* NON-ATOMIC COUNTING SINGLY LINKED LISTS *************/
 
-/* Insertion in stack */
-static inline int stack_insert(dq_ct_node *stack_top, void *page)
+/* Insertion in stack with at most limit entries */
+static inline int stack_insert_bounded(dq_ct_node *stack_top, void *page, const unsigned long int limit)
 {
     /* Stack is full */
-    if(stack_top->count == COUNT_MAX) return 0;
+    if(stack_top->count >= limit || stack_top->count == COUNT_MAX) return 0;
 
     /* new_node->next = head */
     *((dq_ct_node *) page) = *stack_top;
@@ -100,6 +106,12 @@ static inline int stack_insert(dq_ct_node *stack_top, void *page)
     return 1;
 }
 
+/* Insertion in stack */
+static inline int stack_insert(dq_ct_node *stack_top, void *page)
+{
+    return stack_insert_bounded(stack_top, page, COUNT_MAX);
+}
+
 /* Removal from stack */
 static inline page_t *stack_remove(dq_ct_node *stack_top)
 {
@@ -119,8 +131,8 @@ static inline page_t *stack_remove(dq_ct_node *stack_top)
 
 /************* ATOMIC COUNTING SINGLY LINKED LISTS *************/
 
-/* Atomic insertion in stack - Returns 0 in case of failure */
-static inline int stack_insert_atomic(dq_ct_node *stack_top, void *page)
+/* Atomic insertion in stack with at most limit entries - Returns 0 in case of failure */
+static inline int stack_insert_atomic_bounded(dq_ct_node *stack_top, void *page, const unsigned long int limit)
 {
     /* This is only to avoid aliasing errors by the compiler (union) */
     both_count_dq new_head;
@@ -131,7 +143,7 @@ static inline int stack_insert_atomic(dq_ct_node *stack_top, void *page)
         dq_ct_node old_head = *stack_top;
 
         /* Maxed out the queue - Queue counter will overflow */
-        if(old_head.count == COUNT_MAX) return 0;
+        if(old_head.count >= limit || old_head.count == COUNT_MAX) return 0;
 
         /* new_node->next = head */
         *((dq_ct_node *) page) = old_head;
@@ -141,11 +153,18 @@ static inline int stack_insert_atomic(dq_ct_node *stack_top, void *page)
         new_head.top.state = old_head.state + 1;
         new_head.top.nxt = SET_PTR(page);
     }
-    while(!ATOMIC_CAS((unsigned long int *) stack_top, &new_head.both, (unsigned long int *) page));
+    /* Releases the link in the page to whoever removes it */
+    while(!ATOMIC_CAS((unsigned long int *) stack_top, &new_head.both, (unsigned long int *) page, __ATOMIC_RELEASE));
 
     return 1;
 }
 
+/* Atomic insertion in stack - Returns 0 in case of failure */
+static inline int stack_insert_atomic(dq_ct_node *stack_top, void *page)
+{
+    return stack_insert_atomic_bounded(stack_top, page, COUNT_MAX);
+}
+
 /* Atomic removal from stack - Returns NULL in case of failure */
 static inline page_t *stack_remove_atomic(dq_ct_node *stack_top)
 {
@@ -155,10 +174,11 @@ static inline page_t *stack_remove_atomic(dq_ct_node *stack_top)
     /* This is only to avoid aliasing errors by the compiler (use different pointer type) */
     both_count_dq *ref_top = (both_count_dq *) stack_top;
 
+    /* Acquires the link in the top page, a failed swap reloads the top the same way */
+    old_head.both = ATOMIC_LOAD(&ref_top->both, __ATOMIC_ACQUIRE);
+
     while(1)
     {
-        old_head.top = *stack_top;
-
         /* Empty head */
         if(!old_head.top.nxt) return NULL;
 
@@ -167,15 +187,77 @@ static inline page_t *stack_remove_atomic(dq_ct_node *stack_top)
         next.top.count = old_head.top.count - 1;
         next.top.state = old_head.top.state + 1;
 
-        if(ATOMIC_CAS(&ref_top->both, &next.both, &old_head.both))
+        if(ATOMIC_CAS(&ref_top->both, &next.both, &old_head.both, __ATOMIC_ACQUIRE))
             return (page_t *)GET_PTR(old_head.top.nxt);
     }
 }
 
+/* Atomic insertion of a whole non-atomic stack with at most limit entries in total, the chain is left empty -
+ * Returns 0 in case of failure, nothing is inserted then */
+static inline int stack_insert_chain_atomic(dq_ct_node *stack_top, dq_ct_node *chain, const unsigned long int limit)
+{
+    both_count_dq old_head;
+    both_count_dq new_head;
+    both_count_dq *ref_top = (both_count_dq *) stack_top;
+
+    /* Nothing to insert */
+    if(!chain->count) return 1;
+
+    /* Last entry of the chain - Its link is the only one that changes */
+    dq_ct_node *tail = GET_PTR(chain->nxt);
+    for(unsigned long int i = 1; i < chain->count; i++) tail = GET_PTR(tail->nxt);
+
+    /* Nothing in the pages is read through the top */
+    old_head.both = ATOMIC_LOAD(&ref_top->both, __ATOMIC_RELAXED);
+
+    do
+    {
+        const unsigned long int count = (unsigned long int) old_head.top.count + chain->count;
+
+        /* Maxed out the queue - Queue counter will overflow */
+        if(count > limit || count > COUNT_MAX) return 0;
+
+        /* tail->next = head */
+        *tail = old_head.top;
+
+        /* head = chain */
+        new_head.top.count = count;
+        new_head.top.state = old_head.top.state + 1;
+        new_head.top.nxt = chain->nxt;
+    }
+    /* Releases every link of the chain at once, as a single insertion would */
+    while(!ATOMIC_CAS(&ref_top->both, &new_head.both, &old_head.both, __ATOMIC_RELEASE));
+
+    chain->nxt = chain->count = 0;
+
+    return 1;
+}
+
+/* Atomic removal of every entry of a stack at once - They end up in a non-atomic stack */
+static inline void stack_remove_all_atomic(dq_ct_node *stack_top, dq_ct_node *chain)
+{
+    both_count_dq old_head;
+    both_count_dq new_head;
+    both_count_dq *ref_top = (both_count_dq *) stack_top;
+
+    /* Acquires the links of every page, a failed swap reloads the top the same way */
+    old_head.both = ATOMIC_LOAD(&ref_top->both, __ATOMIC_ACQUIRE);
+
+    do
+    {
+        new_head.both = 0;
+        new_head.top.state = old_head.top.state + 1;
+    }
+    while(!ATOMIC_CAS(&ref_top->both, &new_head.both, &old_head.both, __ATOMIC_ACQUIRE));
+
+    *chain = old_head.top;
+    chain->state = 0;
+}
+
 /************* NON-ATOMIC DOUBLY LINKED LISTS *************/
 
 /* Inserts node in the front of the list */
-static inline void insert_front_dq(heap_t *c, page_t *page)
+static inline void insert_front_dq(page_list_t *c, page_t *page)
 {
     if (!c->head)
     {
@@ -185,13 +267,14 @@ static inline void insert_front_dq(heap_t *c, page_t *page)
     else
     {
         page->next = c->head;
+        page->prev = NULL;
         page->next->prev = page;
         c->head = page;
     }
 }
 
 /* Inserts node in the tail of the list */
-static inline void insert_tail_dq(heap_t *c, page_t *page)
+static inline void insert_tail_dq(page_list_t *c, page_t *page)
 {
     if (!c->head)
     {
@@ -202,12 +285,13 @@ static inline void insert_tail_dq(heap_t *c, page_t *page)
     {
         c->tail->next = page;
         page->prev = c->tail;
+        page->next = NULL;
         c->tail = page;
     }
 }
 
 /* Removed node from the front of the list */
-static inline page_t *remove_front_dq(heap_t *c)
+static inline page_t *remove_front_dq(page_list_t *c)
 {
     page_t *curr = c->head;
 
@@ -227,7 +311,7 @@ static inline page_t *remove_front_dq(heap_t *c)
 }
 
 /* Removed node from the tail of the list */
-static inline page_t *remove_tail_dq(heap_t *c)
+static inline page_t *remove_tail_dq(page_list_t *c)
 {
     page_t *curr = c->tail;
 
@@ -247,7 +331,7 @@ static inline page_t *remove_tail_dq(heap_t *c)
 }
 
 /* Removed node from anywhere in the list, assuming the page is not the head */
-static inline void remove_node_dq(heap_t *c, page_t *page)
+static inline void remove_node_dq(page_list_t *c, page_t *page)
 {
     if (page == c->tail)
     {
@@ -263,10 +347,22 @@ static inline void remove_node_dq(heap_t *c, page_t *page)
     page->next = page->prev = NULL;
 }
 
+/* Removes node from anywhere in the list */
+static inline void unlink_dq(page_list_t *c, page_t *page)
+{
+    if (page == c->head)
+        remove_front_dq(c);
+    else
+        remove_node_dq(c, page);
+
+    page->next = page->prev = NULL;
+}
+
 /*********** MACROS FOR OBJECT LOCAL STACKS **************/
 #define STACK_PUSH_OBJECT(page, obj, obj_offset)                         \
     do                                                                   \
     {                                                                    \
+        FREE_MAP_PUSH((page), (obj_offset));                             \
         *(obj) = (page)->freed;             /* cur->next =  head */      \
         (page)->freed = (obj_offset);       /* head = cur */             \
         (page)->allocated_objects--;                                     \
@@ -275,6 +371,7 @@ static inline void remove_node_dq(heap_t *c, page_t *page)
 #define STACK_POP_OBJECT(page, obj)                                         \
     do                                                                      \
     {                                                                       \
+        FREE_MAP_POP((page), (page)->freed);                                \
         (obj) = ((char *)(page)) + page->freed;    /* ret = head */         \
         (page)->freed = *((unsigned int *) (obj)); /* head = head->next */  \
         (page)->allocated_objects++;                                        \
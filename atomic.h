@@ -1,24 +1,51 @@
 #ifndef _ATOMIC_H
 #define _ATOMIC_H
 
-/* TODO - check memory order values, maybe relaxed can help performance */
+/* Memory orders - Every call site passes the weakest one that is correct for it, one of
+ * __ATOMIC_RELAXED, __ATOMIC_ACQUIRE, __ATOMIC_RELEASE, __ATOMIC_ACQ_REL or __ATOMIC_SEQ_CST.
+ * On x86-64 only the compiler sees the difference, on aarch64 they pick the plain, acquiring
+ * or releasing forms of the instructions instead of full barriers. */
 
 /* Atomic types */
 typedef volatile int spin_t;
 
+/* Per architecture - Hint for the core while spinning */
+#if defined(__x86_64__)
+    #define CPU_RELAX()     __builtin_ia32_pause()
+#elif defined(__aarch64__)
+    #define CPU_RELAX()     __asm__ __volatile__("yield" ::: "memory")
+#else
+    #error "Unsupported architecture - Only x86-64 and aarch64 are supported"
+#endif
+
+/* Failure order of a compare and swap - Cannot release, nor be stronger than the success one */
+#define ATOMIC_FAIL_ORDER(order)    (((order) == __ATOMIC_ACQ_REL) ? __ATOMIC_ACQUIRE : (((order) == __ATOMIC_RELEASE) ? __ATOMIC_RELAXED : (order)))
+
+/* Generalized atomic load */
+#define ATOMIC_LOAD(ptr, order) (__atomic_load_n((ptr), (order)))
+
 /* Generalized atomic store */
-#define ATOMIC_STORE(ptr, val) do{__atomic_store((volatile typeof(ptr)) (ptr), (volatile typeof(val)) (val), __ATOMIC_SEQ_CST);} while(0)
+#define ATOMIC_STORE(ptr, val, order) do{__atomic_store((volatile typeof(ptr)) (ptr), (volatile typeof(val)) (val), (order));} while(0)
 
-/* Generalized atomic compare and swap operation */
-#define ATOMIC_CAS(ptr, new_val, old_val) (__atomic_compare_exchange((volatile typeof(ptr))     (ptr),                 \
-                                                                     (volatile typeof(old_val)) (old_val),             \
-                                                                     (volatile typeof(new_val)) (new_val),             \
-                                                                                                        0,             \
-                                                                                         __ATOMIC_SEQ_CST,             \
-                                                                                        __ATOMIC_RELAXED))
+/* Generalized atomic compare and swap operation - On failure old_val gets the current value, with the failure order */
+#define ATOMIC_CAS(ptr, new_val, old_val, order) (__atomic_compare_exchange((volatile typeof(ptr))     (ptr),                 \
+                                                                            (volatile typeof(old_val)) (old_val),             \
+                                                                            (volatile typeof(new_val)) (new_val),             \
+                                                                                                               0,             \
+                                                                                                         (order),             \
+                                                                                      ATOMIC_FAIL_ORDER(order)))
 
 /* Generalized atomic add - Returns the previous value in ptr <Add then Load> */
-#define ATOMIC_ADD(ptr, val) (__atomic_add_fetch((volatile typeof(ptr)) (ptr), (volatile typeof(val)) (val), __ATOMIC_SEQ_CST))
+#define ATOMIC_ADD(ptr, val, order) (__atomic_add_fetch((volatile typeof(ptr)) (ptr), (volatile typeof(val)) (val), (order)))
+
+/* Generalized atomic or - Returns the previous value in ptr <Load then Or> */
+#define ATOMIC_OR(ptr, val, order) (__atomic_fetch_or((volatile typeof(ptr)) (ptr), (val), (order)))
+
+/* Generalized atomic and - Returns the previous value in ptr <Load then And> */
+#define ATOMIC_AND(ptr, val, order) (__atomic_fetch_and((volatile typeof(ptr)) (ptr), (val), (order)))
+
+/* Generalized atomic exchange - Returns the previous value in ptr <Load then Store> */
+#define ATOMIC_EXCHANGE(ptr, val, order) (__atomic_exchange_n((volatile typeof(ptr)) (ptr), (val), (order)))
 
 /* Initializes spin lock */
 static inline void spin_lock_init(spin_t *lock)
@@ -31,14 +58,20 @@ static inline void spin_lock(spin_t *lock)
 {
     do
     {
-        while(*lock);
-    } while(__sync_lock_test_and_set(lock, 1));
+        while(ATOMIC_LOAD(lock, __ATOMIC_RELAXED)) CPU_RELAX();
+    } while(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE));
+}
+
+/* Tries to acquire spin lock once - Returns 1 on success */
+static inline int spin_trylock(spin_t *lock)
+{
+    return !ATOMIC_LOAD(lock, __ATOMIC_RELAXED) && !__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE);
 }
 
 /* Releases spin lock */
 static inline void spin_unlock(spin_t *lock)
 {
-    __sync_lock_release(lock);
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
 }
 
 #endif
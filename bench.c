@@ -0,0 +1,510 @@
+/* Allocator microbenchmarks - Uses whatever malloc the dynamic linker resolves, so the same binary
+ * measures glibc as is and any other allocator through LD_PRELOAD (see run_bench.sh).
+ *
+ * Every benchmark runs in a forked child per thread count, so that the RSS of one run does not
+ * leak into the next one. Reports the throughput, sampled latencies and the peak RSS of the run. */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+/* One in every (SAMPLE_MASK + 1) operations is timed, up to SAMPLES_MAX per thread */
+#define SAMPLE_MASK     15
+#define SAMPLES_MAX     (1 << 17)
+
+#define THREADS_MAX     256
+
+/* Benchmark parameters - Scaled with -n */
+#define THREADTEST_OBJECTS      10000
+#define THREADTEST_ROUNDS       50
+#define LARSON_SLOTS            1000
+#define LARSON_ROUNDS           10
+#define LARSON_ITERS            50000
+#define PRODCONS_OBJECTS        500000
+#define PRODCONS_RING           4096
+#define SCRATCH_ITERS           500000
+#define SCRATCH_WRITES          100
+#define CHURN_OBJECTS           20000
+#define CHURN_ROUNDS            10
+#define CLASSES_ITERS           500000
+#define CLASSES_WINDOW          8
+
+/* Per thread state of a run */
+typedef struct bench_thread
+{
+    int id;
+    unsigned int seed;
+    long ops;
+    int samples_num;
+    unsigned int *samples;      /* Latency samples in ns */
+    void *buf;                  /* Benchmark specific */
+}bench_thread_t;
+
+/* Benchmark description */
+typedef struct bench
+{
+    const char *name;
+    void *(*func)(void *);
+    const char *info;
+}bench_t;
+
+/* Shared state of the run - Set before the threads start */
+static int threads_num = 1;
+static long scale = 1;
+static pthread_barrier_t barrier;
+static bench_thread_t threads[THREADS_MAX];
+
+/***************************** SUPPORTING OPERATIONS **************************/
+
+static inline unsigned long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Runs an allocator operation, timing one in every few of them */
+#define TIMED_OP(th, op)                                                        \
+        do{                                                                     \
+            if(!((th)->ops++ & SAMPLE_MASK) && (th)->samples_num < SAMPLES_MAX) \
+            {                                                                   \
+                const unsigned long __t0 = now_ns();                            \
+                op;                                                             \
+                (th)->samples[(th)->samples_num++] = now_ns() - __t0;           \
+            }                                                                   \
+            else                                                                \
+            {                                                                   \
+                op;                                                             \
+            }                                                                   \
+        }while(0)
+
+/* Random size in [min, max] */
+static inline size_t rand_size(bench_thread_t *th, size_t min, size_t max)
+{
+    return min + rand_r(&th->seed) % (max - min + 1);
+}
+
+/* Resident memory of the process in bytes */
+static long resident_bytes(void)
+{
+    long size = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if(!f) return -1;
+    if(fscanf(f, "%ld %ld", &size, &resident) != 2) resident = -1;
+    fclose(f);
+
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static int uint_cmp(const void *a, const void *b)
+{
+    const unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Shuffler to generate random indexes */
+static void shuffle_func(bench_thread_t *th, int *array, size_t n)
+{
+    for(size_t i = 0; n > 1 && i < n - 1; i++)
+    {
+        size_t j = i + rand_r(&th->seed) % (n - i);
+        int t = array[j];
+        array[j] = array[i];
+        array[i] = t;
+    }
+}
+
+/***************************** BENCHMARKS **************************/
+
+/* Threadtest - Each thread allocates a batch of same sized objects and frees them, over and over */
+static void *bench_threadtest(void *arg)
+{
+    bench_thread_t *th = (bench_thread_t *) arg;
+    const int objects_num = THREADTEST_OBJECTS;
+    void **buf = malloc(objects_num * sizeof(void *));
+
+    pthread_barrier_wait(&barrier);
+
+    for(long r = 0; r < THREADTEST_ROUNDS * scale; r++)
+    {
+        for(int i = 0; i < objects_num; i++)
+        {
+            TIMED_OP(th, buf[i] = malloc(64));
+            *(volatile char *)buf[i] = i;
+        }
+
+        for(int i = 0; i < objects_num; i++) TIMED_OP(th, free(buf[i]));
+    }
+
+    free(buf);
+
+    return NULL;
+}
+
+/* Larson - Threads replace random objects of random sizes in their slots. After each round the slots
+ * move to the next thread, which frees what the previous one allocated (remote frees) */
+static void *bench_larson(void *arg)
+{
+    bench_thread_t *th = (bench_thread_t *) arg;
+    char **slots;
+
+    /* Our own slots to begin with */
+    th->buf = slots = malloc(LARSON_SLOTS * sizeof(char *));
+    for(int i = 0; i < LARSON_SLOTS; i++) slots[i] = malloc(rand_size(th, 16, 512));
+
+    pthread_barrier_wait(&barrier);
+
+    for(long r = 0; r < LARSON_ROUNDS * scale; r++)
+    {
+        for(int i = 0; i < LARSON_ITERS; i++)
+        {
+            const int idx = rand_r(&th->seed) % LARSON_SLOTS;
+            const size_t sz = rand_size(th, 16, 512);
+
+            TIMED_OP(th, free(slots[idx]));
+            TIMED_OP(th, slots[idx] = malloc(sz));
+            slots[idx][0] = (char) i;
+        }
+
+        /* Hand the slots over to the next thread */
+        pthread_barrier_wait(&barrier);
+        slots = (char **)threads[(th->id + 1) % threads_num].buf;
+        pthread_barrier_wait(&barrier);
+        th->buf = slots;
+        pthread_barrier_wait(&barrier);
+    }
+
+    for(int i = 0; i < LARSON_SLOTS; i++) free(slots[i]);
+
+    /* The slot arrays moved around too - Freed once all the threads are done with them */
+    pthread_barrier_wait(&barrier);
+    free(slots);
+
+    return NULL;
+}
+
+/* Producer/consumer ring between a pair of threads - Single producer, single consumer */
+typedef struct ring
+{
+    void *volatile objects[PRODCONS_RING];
+    volatile unsigned long head __attribute__((aligned(64)));
+    volatile unsigned long tail __attribute__((aligned(64)));
+}ring_t;
+
+static ring_t *rings;
+
+/* Xmalloc-test - Producers allocate objects that consumers on other threads free, as in the remote threads test */
+static void *bench_prodcons(void *arg)
+{
+    bench_thread_t *th = (bench_thread_t *) arg;
+    const long objects_num = PRODCONS_OBJECTS * scale;
+
+    pthread_barrier_wait(&barrier);
+
+    /* A single thread plays both roles, a batch at a time */
+    if(threads_num == 1)
+    {
+        void *batch[PRODCONS_RING];
+
+        for(long done = 0; done < objects_num; done += PRODCONS_RING)
+        {
+            for(int i = 0; i < PRODCONS_RING; i++) TIMED_OP(th, batch[i] = malloc(rand_size(th, 16, 256)));
+            for(int i = 0; i < PRODCONS_RING; i++) TIMED_OP(th, free(batch[i]));
+        }
+
+        return NULL;
+    }
+
+    /* Odd threads out of a pair have nothing to do */
+    if((th->id | 1) >= threads_num) return NULL;
+
+    ring_t *ring = &rings[th->id >> 1];
+
+    if(!(th->id & 1)) /* Producer */
+    {
+        for(long i = 0; i < objects_num; i++)
+        {
+            void *obj;
+
+            TIMED_OP(th, obj = malloc(rand_size(th, 16, 256)));
+            *(volatile char *)obj = (char) i;
+
+            while(ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == PRODCONS_RING) sched_yield();
+
+            ring->objects[ring->head % PRODCONS_RING] = obj;
+            __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    else /* Consumer */
+    {
+        for(long i = 0; i < objects_num; i++)
+        {
+            while(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) sched_yield();
+
+            void *obj = ring->objects[ring->tail % PRODCONS_RING];
+            __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+
+            TIMED_OP(th, free(obj));
+        }
+    }
+
+    return NULL;
+}
+
+/* Cache-scratch - Each thread frees an object the main thread allocated next to the objects of the other
+ * threads, then keeps allocating and writing small objects. Allocators that reuse the freed object hand
+ * out the same cache lines to different threads (passive false sharing) */
+static void *bench_scratch(void *arg)
+{
+    bench_thread_t *th = (bench_thread_t *) arg;
+
+    pthread_barrier_wait(&barrier);
+
+    TIMED_OP(th, free(th->buf));
+
+    for(long i = 0; i < SCRATCH_ITERS * scale; i++)
+    {
+        volatile char *obj;
+
+        TIMED_OP(th, obj = (volatile char *)malloc(8));
+
+        for(int j = 0; j < SCRATCH_WRITES; j++) obj[j & 7]++;
+
+        TIMED_OP(th, free((void *)obj));
+    }
+
+    return NULL;
+}
+
+/* Sized-churn - Random sizes over all the small classes and some large ones, freed in a shuffled order,
+ * as in the shuffle threads test */
+static void *bench_churn(void *arg)
+{
+    bench_thread_t *th = (bench_thread_t *) arg;
+    void **buf = malloc(CHURN_OBJECTS * sizeof(void *));
+    int *idx = malloc(CHURN_OBJECTS * sizeof(int));
+
+    for(int i = 0; i < CHURN_OBJECTS; i++) idx[i] = i;
+
+    pthread_barrier_wait(&barrier);
+
+    for(long r = 0; r < CHURN_ROUNDS * scale; r++)
+    {
+        for(int i = 0; i < CHURN_OBJECTS; i++)
+        {
+            /* Mostly small, one in 64 up to 64KB */
+            const size_t sz = (rand_r(&th->seed) & 63) ? rand_size(th, 1, 2048) : rand_size(th, 2048, 65536);
+
+            TIMED_OP(th, buf[i] = malloc(sz));
+            *(volatile char *)buf[i] = (char) i;
+        }
+
+        shuffle_func(th, idx, CHURN_OBJECTS);
+
+        for(int i = 0; i < CHURN_OBJECTS; i++) TIMED_OP(th, free(buf[idx[i]]));
+    }
+
+    free(idx);
+    free(buf);
+
+    return NULL;
+}
+
+/* Classes - Short lived objects stepping through every small size, mostly the class lookups of malloc and free */
+static void *bench_classes(void *arg)
+{
+    bench_thread_t *th = (bench_thread_t *) arg;
+    void *objects[CLASSES_WINDOW];
+    size_t sz = 1;
+
+    pthread_barrier_wait(&barrier);
+
+    for(long i = 0; i < CLASSES_ITERS * scale; i++)
+    {
+        for(int j = 0; j < CLASSES_WINDOW; j++)
+        {
+            TIMED_OP(th, objects[j] = malloc(sz));
+            *(volatile char *)objects[j] = (char) j;
+            sz = (sz + 37) % 2047 + 1;
+        }
+
+        for(int j = 0; j < CLASSES_WINDOW; j++) TIMED_OP(th, free(objects[j]));
+    }
+
+    return NULL;
+}
+
+static const bench_t benches[] =
+{
+    {"threadtest",  bench_threadtest,   "batches of 64B objects, local frees"},
+    {"larson",      bench_larson,       "random replacements of 16-512B objects, slots move between threads"},
+    {"prodcons",    bench_prodcons,     "producer/consumer pairs of 16-256B objects, remote frees"},
+    {"scratch",     bench_scratch,      "8B objects written in a loop, passive false sharing"},
+    {"churn",       bench_churn,        "random sizes up to 64KB, shuffled frees"},
+    {"classes",     bench_classes,      "short lived objects of every small size, class lookups"},
+};
+
+#define BENCHES_NUM ((int)(sizeof(benches) / sizeof(benches[0])))
+
+/***************************** RUNNER **************************/
+
+/* Runs a benchmark with the current number of threads and prints a line with its results */
+static void bench_run(const bench_t *bench)
+{
+    pthread_t tid[THREADS_MAX];
+    unsigned int *all_samples;
+    long ops = 0, samples_num = 0, peak_rss = resident_bytes();
+    void *scratch[THREADS_MAX];
+
+    pthread_barrier_init(&barrier, NULL, threads_num + 1);
+
+    if(bench->func == bench_prodcons) rings = calloc(threads_num / 2 + 1, sizeof(ring_t));
+
+    /* Neighbouring objects of the main thread for the cache-scratch benchmark */
+    for(int i = 0; i < threads_num; i++) scratch[i] = (bench->func == bench_scratch) ? malloc(8) : NULL;
+
+    for(int i = 0; i < threads_num; i++)
+    {
+        threads[i].id = i;
+        threads[i].seed = 1234 + i;
+        threads[i].ops = 0;
+        threads[i].samples_num = 0;
+        threads[i].samples = malloc(SAMPLES_MAX * sizeof(unsigned int));
+        threads[i].buf = scratch[i];
+        pthread_create(&tid[i], NULL, bench->func, &threads[i]);
+    }
+
+    /* Start them all at once */
+    pthread_barrier_wait(&barrier);
+    const unsigned long start = now_ns();
+
+    /* Larson hands its slots over in steps of 3 barriers */
+    if(bench->func == bench_larson)
+    {
+        for(long r = 0; r < 3 * LARSON_ROUNDS * scale + 1; r++)
+        {
+            pthread_barrier_wait(&barrier);
+
+            const long rss = resident_bytes();
+            if(rss > peak_rss) peak_rss = rss;
+        }
+    }
+
+    for(int i = 0; i < threads_num; i++) pthread_join(tid[i], NULL);
+    const double elapsed = (now_ns() - start) / 1e9;
+
+    /* Peak RSS of the process - The allocator keeps what it did not give back */
+    const long rss = resident_bytes();
+    if(rss > peak_rss) peak_rss = rss;
+
+    for(int i = 0; i < threads_num; i++)
+    {
+        ops += threads[i].ops;
+        samples_num += threads[i].samples_num;
+    }
+
+    all_samples = malloc((samples_num + 1) * sizeof(unsigned int));
+    samples_num = 0;
+
+    for(int i = 0; i < threads_num; i++)
+    {
+        memcpy(all_samples + samples_num, threads[i].samples, threads[i].samples_num * sizeof(unsigned int));
+        samples_num += threads[i].samples_num;
+        free(threads[i].samples);
+    }
+
+    qsort(all_samples, samples_num, sizeof(unsigned int), uint_cmp);
+
+    #define PERCENTILE(p) (samples_num ? all_samples[(long)((samples_num - 1) * (p))] : 0)
+
+    printf("%-12s threads %3d  ops/s %10.3fM  p50 %6uns  p99 %7uns  p999 %8uns  rss %8.1fMB\n",
+           bench->name, threads_num, ops / elapsed / 1e6,
+           PERCENTILE(0.5), PERCENTILE(0.99), PERCENTILE(0.999), peak_rss / (1024.0 * 1024.0));
+    fflush(stdout);
+
+    free(all_samples);
+    pthread_barrier_destroy(&barrier);
+}
+
+static void usage(const char *prog)
+{
+    printf("Usage: %s [-t threads,...] [-b benchmark,...] [-n scale]\n", prog);
+    printf("  -t  Thread counts to run with (default 1,2,4)\n");
+    printf("  -b  Benchmarks to run (default all)\n");
+    printf("  -n  Multiplier of the work of each benchmark (default 1)\n");
+    printf("Benchmarks:\n");
+    for(int i = 0; i < BENCHES_NUM; i++) printf("  %-12s %s\n", benches[i].name, benches[i].info);
+}
+
+int main(int argc, char **argv)
+{
+    char threads_list[256] = "1,2,4";
+    char *bench_list = NULL;
+    int opt;
+
+    while((opt = getopt(argc, argv, "t:b:n:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 't': snprintf(threads_list, sizeof(threads_list), "%s", optarg); break;
+            case 'b': bench_list = optarg; break;
+            case 'n': scale = atol(optarg); break;
+            default: usage(argv[0]); return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if(scale < 1) scale = 1;
+
+    for(int b = 0; b < BENCHES_NUM; b++)
+    {
+        /* Filtered out */
+        if(bench_list)
+        {
+            char list[256], *save = NULL;
+            int found = 0;
+
+            snprintf(list, sizeof(list), "%s", bench_list);
+            for(char *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+                found |= !strcmp(tok, benches[b].name);
+
+            if(!found) continue;
+        }
+
+        char list[256], *save = NULL;
+        snprintf(list, sizeof(list), "%s", threads_list);
+
+        for(char *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+        {
+            threads_num = atoi(tok);
+
+            if(threads_num < 1 || threads_num > THREADS_MAX)
+            {
+                printf("Thread count has to be in [1, %d]: %d\n", THREADS_MAX, threads_num);
+                return 1;
+            }
+
+            /* A fresh process for every run */
+            pid_t pid = fork();
+
+            if(pid == 0)
+            {
+                bench_run(&benches[b]);
+                exit(0);
+            }
+
+            if(pid < 0 || waitpid(pid, NULL, 0) < 0) return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+#!/bin/bash
+
+#Find the absolute path where we are called from
+SCRIPT_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" &> /dev/null && pwd )"
+
+#Arguments are passed to the benchmark - e.g. ./run_bench.sh -t 1,2,4,8 -b larson
+BENCH=$SCRIPT_DIR/xmalloc_bench
+
+#Allocators to compare - Other ones are found through the dynamic linker cache, or set with JEMALLOC/TCMALLOC
+JEMALLOC=${JEMALLOC:-$(ldconfig -p 2>/dev/null | grep -m1 -o '/[^ ]*libjemalloc\.so[^ ]*')}
+TCMALLOC=${TCMALLOC:-$(ldconfig -p 2>/dev/null | grep -m1 -o '/[^ ]*libtcmalloc_minimal\.so[^ ]*')}
+
+echo "************ glibc ************"
+$BENCH "$@"
+
+echo "************ xmalloc **********"
+LD_PRELOAD=$SCRIPT_DIR/libxmalloc.so $BENCH "$@"
+
+if [ -n "$JEMALLOC" ]; then
+  echo "************ jemalloc *********"
+  LD_PRELOAD=$JEMALLOC $BENCH "$@"
+fi
+
+if [ -n "$TCMALLOC" ]; then
+  echo "************ tcmalloc *********"
+  LD_PRELOAD=$TCMALLOC $BENCH "$@"
+fi
@@ -10,8 +10,11 @@ export LD_LIBRARY_PATH=$LD_LIBRARY_PATH:$SCRIPT_DIR
 LD_PRELOAD=$SCRIPT_DIR/libxmalloc.so
 
 #Run test_alloc for each case
-for ((c=0; c < 9; c++))
+for ((c=0; c < 25; c++))
 do
   ./test_alloc $c
 done
 
+#Heap profiling is only on from the start
+XMALLOC_PROF_SAMPLE=65536 ./test_alloc 16
+
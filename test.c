@@ -9,6 +9,9 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <getopt.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
 
 #include "allocator.h"
 
@@ -385,7 +388,7 @@ int test_atomic_counting_queues(int threads_num, int allocs)
     }
 
     /* Threads are free to run now */
-    ATOMIC_CAS(&pass, &new, &old);
+    ATOMIC_CAS(&pass, &new, &old, __ATOMIC_SEQ_CST);
 
     for (int i = 0; i < threads_num; i++)
     {
@@ -526,6 +529,1067 @@ int test_class_integrity_realloc(int allocs)
     return 1;
 }
 
+/* Test for realloc growth/shrinking of large objects */
+int test_large_realloc_integrity(int max_allocation_sz)
+{
+    unsigned char *buf = NULL;
+    int cur_sz = 0;
+
+    /* Grow by odd steps - The already written part has to survive */
+    for(int i = 1; i <= max_allocation_sz; i = i + (i >> 1) + 7)
+    {
+        buf = realloc(buf, i);
+
+        if(!buf)
+        {
+            printf("Realloc failed for [%d] size\n", i);
+            return 0;
+        }
+
+        for(int j = 0; j < cur_sz; j++)
+        {
+            if(buf[j] != (unsigned char)(j * 7))
+            {
+                printf("Realloc grow corrupted [%d] size at [%d]\n", i, j);
+                return 0;
+            }
+        }
+
+        for(int j = cur_sz; j < i; j++) buf[j] = (unsigned char)(j * 7);
+        cur_sz = i;
+    }
+
+    /* Shrink back - The kept part has to survive */
+    for(int i = cur_sz; i > 0; i >>= 1)
+    {
+        buf = realloc(buf, i);
+
+        if(!buf)
+        {
+            printf("Realloc failed for [%d] size\n", i);
+            return 0;
+        }
+
+        for(int j = 0; j < i; j++)
+        {
+            if(buf[j] != (unsigned char)(j * 7))
+            {
+                printf("Realloc shrink corrupted [%d] size at [%d]\n", i, j);
+                return 0;
+            }
+        }
+    }
+
+    free(buf);
+
+    return 1;
+}
+
+int test_calloc_zeroed(int rounds)
+{
+    const int sizes[] = {1, 15, 16, 100, 512, 1000, 2047, 2048, 5000, 40000, 300000, 2 << 20};
+    const int sizes_num = sizeof(sizes) / sizeof(sizes[0]);
+    unsigned char *buf[64];
+
+    for(int r = 0; r < rounds; r++)
+    {
+        for(int s = 0; s < sizes_num; s++)
+        {
+            /* Dirty memory first, so that recycled objects hold garbage */
+            for(int i = 0; i < 64; i++)
+            {
+                buf[i] = malloc(sizes[s]);
+                if(!buf[i]) return 0;
+                memset(buf[i], 0xAB, sizes[s]);
+            }
+
+            for(int i = 0; i < 64; i++) free(buf[i]);
+
+            /* Both recycled and fresh objects must come back zeroed */
+            for(int i = 0; i < 64; i++)
+            {
+                buf[i] = calloc(1, sizes[s]);
+
+                if(!buf[i])
+                {
+                    printf("Calloc failed for [%d] size\n", sizes[s]);
+                    return 0;
+                }
+
+                for(int j = 0; j < sizes[s]; j++)
+                {
+                    if(buf[i][j])
+                    {
+                        printf("Calloc not zeroed for [%d] size at [%d]\n", sizes[s], j);
+                        return 0;
+                    }
+                }
+
+                memset(buf[i], 0xCD, sizes[s]);
+            }
+
+            for(int i = 0; i < 64; i++) free(buf[i]);
+        }
+    }
+
+    /* Overflowing requests are refused - Through volatiles, so the compiler cannot see the overflow */
+    volatile size_t huge_nmemb = (size_t)1 << 40, huge_sz = (size_t)1 << 40;
+    if(calloc(huge_nmemb, huge_sz)) return 0;
+
+    return 1;
+}
+
+/* Resident memory of the process in bytes */
+static long resident_bytes(void)
+{
+    long size = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if(!f) return -1;
+    if(fscanf(f, "%ld %ld", &size, &resident) != 2) resident = -1;
+    fclose(f);
+
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+int test_trim(int objects_num)
+{
+    char **buf = malloc(objects_num * sizeof(char *));
+    if(!buf) return 0;
+
+    for(int i = 0; i < objects_num; i++)
+    {
+        buf[i] = malloc(1000);
+        if(!buf[i]) return 0;
+        memset(buf[i], 0xAB, 1000);
+    }
+
+    for(int i = 0; i < objects_num; i++) free(buf[i]);
+
+    /* Everything is cached now - Most of it has to go back */
+    long before = resident_bytes();
+    malloc_trim(0);
+    long after = resident_bytes();
+
+    if(before < 0 || after < 0 || before - after < ((long)objects_num * 1000) / 2)
+    {
+        printf("Trim released only [%ld] bytes out of [%ld]\n", before - after, before);
+        return 0;
+    }
+
+    /* Purged pageblocks are reused and still hand out zeroed memory */
+    for(int i = 0; i < objects_num; i++)
+    {
+        buf[i] = calloc(1, 1000);
+        if(!buf[i]) return 0;
+
+        for(int j = 0; j < 1000; j++)
+        {
+            if(buf[i][j])
+            {
+                printf("Calloc after trim not zeroed at [%d]\n", j);
+                return 0;
+            }
+        }
+    }
+
+    for(int i = 0; i < objects_num; i++) free(buf[i]);
+    free(buf);
+
+    return 1;
+}
+
+/* Allocates objects that the main thread frees - Remote frees */
+void *thread_stats_func(void *arg)
+{
+    arg_t *args = (arg_t *) arg;
+    void **buf = (void **) args->buf;
+
+    for(int i = args->low; i < args->high; i++) buf[i] = malloc(100);
+
+    return NULL;
+}
+
+int test_stats(int objects_num)
+{
+    xmalloc_stats_t before, after;
+    void **buf = malloc(objects_num * sizeof(void *));
+    const int class_idx = 6; /* 100 bytes + header is class 112 */
+    pthread_t tid;
+    arg_t args;
+
+    if(!buf || xmalloc_stats_get(&before)) return 0;
+
+    if(before.classes[class_idx].object_size != 112 || !before.mapped || !before.resident || !before.threads)
+    {
+        printf("Stats are not initialized\n");
+        return 0;
+    }
+
+    for(int i = 0; i < objects_num; i++) buf[i] = malloc(100);
+    void *volatile large = malloc(1 << 20); /* Volatile, so that the pair is not optimized away */
+
+    xmalloc_stats_get(&after);
+
+    if(after.classes[class_idx].live_objects - before.classes[class_idx].live_objects != (size_t)objects_num ||
+       after.large_live_objects - before.large_live_objects != 1 || !after.classes[class_idx].pageblocks ||
+       after.allocated - before.allocated < (size_t)objects_num * 112 + (1 << 20))
+    {
+        printf("Stats missed the allocations\n");
+        return 0;
+    }
+
+    for(int i = 0; i < objects_num; i++) free(buf[i]);
+    free(large);
+
+    xmalloc_stats_get(&after);
+
+    if(after.classes[class_idx].live_objects != before.classes[class_idx].live_objects ||
+       after.large_live_objects != before.large_live_objects)
+    {
+        printf("Stats missed the frees\n");
+        return 0;
+    }
+
+    /* Objects of an exited thread freed here - Counted as remote frees at the latest when our cache drains */
+    args.low = 0;
+    args.high = objects_num;
+    args.buf = buf;
+    pthread_create(&tid, NULL, thread_stats_func, &args);
+    pthread_join(tid, NULL);
+
+    for(int i = 0; i < objects_num; i++) free(buf[i]);
+
+    xmalloc_stats_get(&after);
+
+    if(after.classes[class_idx].live_objects != before.classes[class_idx].live_objects ||
+       after.classes[class_idx].remote_frees <= before.classes[class_idx].remote_frees ||
+       after.threads != before.threads)
+    {
+        printf("Stats missed the remote frees\n");
+        return 0;
+    }
+
+    free(buf);
+
+    return 1;
+}
+
+/* Allocates objects that outlive the thread */
+void *thread_local_func_no_free(void *arg)
+{
+    arg_t *args = (arg_t *) arg;
+    void **buf = (void **) args->buf;
+
+    for(int i = args->low; i < args->high; i++) buf[i] = malloc(200);
+
+    return NULL;
+}
+
+/* Allocates objects and frees every other one - The pageblocks are orphaned half full when the thread exits */
+void *thread_orphan_func(void *arg)
+{
+    arg_t *args = (arg_t *) arg;
+    void **buf = (void **) args->buf;
+
+    for(int i = args->low; i < args->high; i++) buf[i] = malloc(200);
+
+    for(int i = args->low; i < args->high; i += 2)
+    {
+        free(buf[i]);
+        buf[i] = NULL;
+    }
+
+    return NULL;
+}
+
+int test_orphan_adoption(int objects_num, int rounds)
+{
+    xmalloc_stats_t before, after;
+    void **buf = malloc(objects_num * sizeof(void *));
+    void **more = malloc((objects_num / 2) * sizeof(void *));
+    const int class_idx = 12; /* 200 bytes + header is class 208 */
+    pthread_t tid;
+    arg_t args;
+
+    if(!buf || !more) return 0;
+
+    for(int r = 0; r < rounds; r++)
+    {
+        /* Leaves its pageblocks half full behind */
+        args.low = 0;
+        args.high = objects_num;
+        args.buf = buf;
+
+        pthread_create(&tid, NULL, thread_orphan_func, &args);
+        pthread_join(tid, NULL);
+
+        xmalloc_stats_get(&before);
+
+        /* The next thread fills the orphaned pageblocks instead of taking new ones */
+        args.high = objects_num / 2;
+        args.buf = more;
+
+        pthread_create(&tid, NULL, thread_local_func_no_free, &args);
+        pthread_join(tid, NULL);
+
+        xmalloc_stats_get(&after);
+
+        if(after.classes[class_idx].pageblocks > before.classes[class_idx].pageblocks + 2)
+        {
+            printf("Orphaned pageblocks were not adopted, [%zu] new pageblocks\n",
+                   after.classes[class_idx].pageblocks - before.classes[class_idx].pageblocks);
+            return 0;
+        }
+
+        /* Our frees steal them, the emptied pageblocks are released */
+        for(int i = 0; i < objects_num; i++) free(buf[i]);
+        for(int i = 0; i < objects_num / 2; i++) free(more[i]);
+    }
+
+    free(more);
+    free(buf);
+
+    return 1;
+}
+
+int test_aligned(void)
+{
+    const size_t alignments[] = {32, 64, 128, 256, 1024, 2048, 4096, 65536, 2 * 1024 * 1024};
+    const size_t sizes[] = {1, 24, 200, 1000, 2047, 5000, 100000, 3 * 1024 * 1024};
+    void *buf[64];
+
+    for(int a = 0; a < sizeof(alignments) / sizeof(alignments[0]); a++)
+    {
+        for(int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            for(int i = 0; i < 64; i++)
+            {
+                if(posix_memalign(&buf[i], alignments[a], sizes[s]) || !buf[i])
+                {
+                    printf("Posix_memalign failed for [%zu] size [%zu] alignment\n", sizes[s], alignments[a]);
+                    return 0;
+                }
+
+                if((uintptr_t)buf[i] & (alignments[a] - 1))
+                {
+                    printf("Object [%p] of [%zu] size not aligned at [%zu]\n", buf[i], sizes[s], alignments[a]);
+                    return 0;
+                }
+
+                memset(buf[i], 0xAB, sizes[s]);
+            }
+
+            /* Growing keeps the contents */
+            if(sizes[s] > 4096)
+            {
+                unsigned char *obj = realloc(buf[0], sizes[s] * 2);
+
+                if(!obj || obj[0] != 0xAB || obj[sizes[s] - 1] != 0xAB)
+                {
+                    printf("Realloc of aligned object of [%zu] size broke it\n", sizes[s]);
+                    return 0;
+                }
+
+                memset(obj, 0xCD, sizes[s] * 2);
+                buf[0] = obj;
+            }
+
+            for(int i = 0; i < 64; i++) free(buf[i]);
+        }
+    }
+
+    /* The other interfaces end up in the same path */
+    void *obj = aligned_alloc(64, 100);
+    if(!obj || ((uintptr_t)obj & 63)) return 0;
+    free(obj);
+
+    obj = memalign(128, 3000);
+    if(!obj || ((uintptr_t)obj & 127)) return 0;
+    free(obj);
+
+    obj = valloc(100);
+    if(!obj || ((uintptr_t)obj & 4095)) return 0;
+    free(obj);
+
+    obj = pvalloc(5000);
+    if(!obj || ((uintptr_t)obj & 4095)) return 0;
+    memset(obj, 0xAB, 8192);
+    free(obj);
+
+    /* Invalid alignments are refused */
+    if(posix_memalign(&obj, 24, 100) == 0 || posix_memalign(&obj, 4, 100) == 0) return 0;
+    if(aligned_alloc(48, 100)) return 0;
+
+    return 1;
+}
+
+int test_sized_free(void)
+{
+    const size_t sizes[] = {1, 16, 100, 500, 1000, 2047, 3000, 100000};
+    const size_t alignments[] = {16, 64, 1024, 4096};
+    xmalloc_stats_t before, after;
+    char *buf[64];
+
+    xmalloc_stats_get(&before);
+
+    for(int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        for(int i = 0; i < 64; i++)
+        {
+            buf[i] = malloc(sizes[s]);
+            if(!buf[i]) return 0;
+
+            /* The slack of the class can be used */
+            size_t usable = malloc_usable_size(buf[i]);
+
+            if(usable < sizes[s])
+            {
+                printf("Usable size [%zu] of [%zu] size object is too small\n", usable, sizes[s]);
+                return 0;
+            }
+
+            memset(buf[i], 0xAB, usable);
+        }
+
+        /* Shrinking to a smaller class frees with the new size */
+        buf[0] = realloc(buf[0], sizes[s] / 2 + 1);
+        if(!buf[0]) return 0;
+
+        free_sized(buf[0], sizes[s] / 2 + 1);
+        for(int i = 1; i < 64; i++) free_sized(buf[i], sizes[s]);
+
+        for(int a = 0; a < sizeof(alignments) / sizeof(alignments[0]); a++)
+        {
+            for(int i = 0; i < 64; i++)
+            {
+                if(posix_memalign((void **)&buf[i], alignments[a], sizes[s])) return 0;
+                memset(buf[i], 0xCD, malloc_usable_size(buf[i]));
+            }
+
+            for(int i = 0; i < 64; i++) free_aligned_sized(buf[i], alignments[a], sizes[s]);
+        }
+    }
+
+    xmalloc_stats_get(&after);
+
+    /* Every object went back to its own class */
+    for(int i = 0; i < XMALLOC_STATS_CLASSES; i++)
+    {
+        if(after.classes[i].live_objects != before.classes[i].live_objects)
+        {
+            printf("Sized frees lost objects of class [%d]\n", i);
+            return 0;
+        }
+    }
+
+    return after.large_live_objects == before.large_live_objects && malloc_usable_size(NULL) == 0;
+}
+
+static int ptr_cmp(const void *a, const void *b)
+{
+    const uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+int test_cache_line(void)
+{
+    const size_t sizes[] = {1, 40, 64, 100, 192, 320, 1000, 1984, 2048, 5000};
+    char *buf[256];
+
+    for(int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        const size_t padded = (sizes[s] + 63) & ~(size_t)63;
+
+        for(int i = 0; i < 256; i++)
+        {
+            buf[i] = malloc_ex(sizes[s], XMALLOC_CACHE_LINE);
+
+            if(!buf[i] || ((uintptr_t)buf[i] & 63))
+            {
+                printf("Object [%p] of [%zu] size not line aligned\n", buf[i], sizes[s]);
+                return 0;
+            }
+
+            memset(buf[i], 0xAB, padded);
+        }
+
+        /* No two objects share a line */
+        qsort(buf, 256, sizeof(char *), ptr_cmp);
+
+        for(int i = 1; i < 256; i++)
+        {
+            if(buf[i - 1] + padded > buf[i])
+            {
+                printf("Objects [%p] and [%p] of [%zu] size share a line\n", buf[i - 1], buf[i], sizes[s]);
+                return 0;
+            }
+        }
+
+        for(int i = 0; i < 256; i++) free(buf[i]);
+    }
+
+    return 1;
+}
+
+/* Frees the objects the main thread handed off */
+void *thread_handoff_func(void *arg)
+{
+    arg_t *args = (arg_t *)arg;
+
+    for(int i = args->low; i < args->high; i++) free(((void **)args->buf)[i]);
+
+    return NULL;
+}
+
+int test_handoff(int objects_num)
+{
+    xmalloc_stats_t before, after;
+    void **buf = malloc(objects_num * sizeof(void *));
+    const int class_idx = 6; /* 100 bytes + header is class 112 */
+    int handed = 0;
+    pthread_t tid;
+    arg_t args;
+
+    if(!buf || xmalloc_stats_get(&before)) return 0;
+
+    for(int i = 0; i < objects_num; i++)
+    {
+        buf[i] = malloc(100);
+        if(!buf[i]) return 0;
+        memset(buf[i], 0xAB, 100);
+    }
+
+    /* Once per pageblock - The rest of its objects are not ours anymore */
+    for(int i = 0; i < objects_num; i++) handed += !xmalloc_handoff(buf[i]);
+
+    if(!handed || !xmalloc_handoff(buf[0]) || !xmalloc_handoff(NULL))
+    {
+        printf("Handed off [%d] pageblocks\n", handed);
+        return 0;
+    }
+
+    /* We are still alive - The frees of the consumer steal the pageblocks instead of pushing remotely */
+    args.low = 0;
+    args.high = objects_num;
+    args.buf = buf;
+    pthread_create(&tid, NULL, thread_handoff_func, &args);
+    pthread_join(tid, NULL);
+
+    xmalloc_stats_get(&after);
+
+    if(after.classes[class_idx].steals - before.classes[class_idx].steals < (size_t)handed ||
+       after.classes[class_idx].remote_frees - before.classes[class_idx].remote_frees > (size_t)objects_num / 4)
+    {
+        printf("Handoff steals [%zu] of [%d] pageblocks with [%zu] remote frees\n", after.classes[class_idx].steals - before.classes[class_idx].steals,
+                handed, after.classes[class_idx].remote_frees - before.classes[class_idx].remote_frees);
+        return 0;
+    }
+
+    /* Still usable afterwards */
+    for(int i = 0; i < objects_num; i++) buf[i] = malloc(100);
+    for(int i = 0; i < objects_num; i++) free(buf[i]);
+
+    free(buf);
+
+    return 1;
+}
+
+/* Live samples of a heap profile dump - Negative on failure */
+static long int heap_profile_samples(const char *path)
+{
+    long int samples = -1;
+
+    if(xmalloc_prof_dump(path)) return -1;
+
+    FILE *file = fopen(path, "r");
+    if(!file) return -1;
+    if(fscanf(file, "heap profile: %ld:", &samples) != 1) samples = -1;
+
+    fclose(file);
+    unlink(path);
+
+    return samples;
+}
+
+int test_heap_profile(void)
+{
+    const size_t sizes[] = {8, 100, 1000, 2000, 5000, 100000};
+    char path[64];
+    void *objects[6 * 1000];
+    int n = 0;
+
+    snprintf(path, sizeof(path), "/tmp/xmalloc_prof.%d", (int)getpid());
+
+    /* Nothing to dump unless it was turned on at start up */
+    if(!getenv("XMALLOC_PROF_SAMPLE")) return xmalloc_prof_dump(path) == -1;
+
+    for(int i = 0; i < 1000; i++)
+    for(int s = 0; s < 6; s++)
+    {
+        char *obj = (s & 1) ? calloc(1, sizes[s]) : malloc(sizes[s]);
+        if(!obj) return 0;
+
+        /* Sampled ones are objects like any other */
+        for(size_t j = 0; j < sizes[s]; j++)
+        {
+            if((s & 1) && obj[j]) return 0;
+        }
+
+        memset(obj, 0xCD, sizes[s]);
+        objects[n++] = obj;
+    }
+
+    /* About 100MB in 64KB intervals */
+    const long int live = heap_profile_samples(path);
+    if(live < 100) return 0;
+
+    for(int i = 0; i < n; i++)
+    {
+        if(i & 1) free(objects[i]);
+        else objects[i] = realloc(objects[i], 3000);
+    }
+
+    for(int i = 0; i < n; i += 2) free_sized(objects[i], 3000);
+
+    const long int left = heap_profile_samples(path);
+
+    return left >= 0 && left < live / 10;
+}
+
+/* Frees ranges of objects of another thread in single batches, until it gets no buffer - Kept alive through the whole test,
+ * so that only the frees are counted */
+static pthread_barrier_t batch_barrier;
+
+void *thread_batch_free_func(void *arg)
+{
+    arg_t *args = (arg_t *)arg;
+
+    while(1)
+    {
+        pthread_barrier_wait(&batch_barrier);
+        if(!args->buf) break;
+
+        free_batch((void **)args->buf + args->low, args->high - args->low);
+        pthread_barrier_wait(&batch_barrier);
+    }
+
+    return NULL;
+}
+
+int test_batch(void)
+{
+    const size_t sizes[] = {8, 100, 1000, 2047, 5000};
+    const size_t nums[] = {32, 100, 256};
+    xmalloc_stats_t before, after;
+    void *buf[256];
+    pthread_t tid;
+    arg_t args = {0};
+
+    pthread_barrier_init(&batch_barrier, NULL, 2);
+    pthread_create(&tid, NULL, thread_batch_free_func, &args);
+
+    /* Its first free sets up its thread data, which allocates */
+    buf[0] = malloc(1);
+    args.low = 0;
+    args.high = 1;
+    args.buf = buf;
+    pthread_barrier_wait(&batch_barrier);
+    pthread_barrier_wait(&batch_barrier);
+
+    xmalloc_stats_get(&before);
+
+    for(int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    for(int n = 0; n < sizeof(nums) / sizeof(nums[0]); n++)
+    {
+        if(malloc_batch(sizes[s], buf, nums[n]) != nums[n]) return 0;
+
+        for(size_t i = 0; i < nums[n]; i++) memset(buf[i], i & 0xFF, sizes[s]);
+
+        /* No two objects overlap */
+        qsort(buf, nums[n], sizeof(void *), ptr_cmp);
+
+        for(size_t i = 1; i < nums[n]; i++)
+        {
+            if((char *)buf[i - 1] + sizes[s] > (char *)buf[i])
+            {
+                printf("Batch objects of [%zu] bytes overlap\n", sizes[s]);
+                return 0;
+            }
+        }
+
+        /* Half of them here with a hole, the rest remotely */
+        free(buf[0]);
+        buf[0] = NULL;
+        free_batch(buf, nums[n] / 2);
+
+        args.low = nums[n] / 2;
+        args.high = nums[n];
+        args.buf = buf;
+        pthread_barrier_wait(&batch_barrier);
+        pthread_barrier_wait(&batch_barrier);
+    }
+
+    xmalloc_stats_get(&after);
+
+    args.buf = NULL;
+    pthread_barrier_wait(&batch_barrier);
+    pthread_join(tid, NULL);
+    pthread_barrier_destroy(&batch_barrier);
+
+    /* Every object went back to its own class */
+    for(int i = 0; i < XMALLOC_STATS_CLASSES; i++)
+    {
+        if(after.classes[i].live_objects != before.classes[i].live_objects)
+        {
+            printf("Batch frees lost objects of class [%d]\n", i);
+            return 0;
+        }
+    }
+
+    return after.large_live_objects == before.large_live_objects && malloc_batch(0, buf, 1) == 0;
+}
+
+/* Forks while other threads hold pageblocks and churn through the allocator - Each child must not deadlock on a lock
+ * they held, nor leak what they left behind. The half freed pageblocks of the holder end up stolen by the child.
+ * The holder also caches objects of the forking thread, which the child frees on its behalf. */
+#define FORK_FOREIGN_OBJECTS 16
+
+static pthread_barrier_t fork_barrier;
+static volatile int fork_done = 0;
+static void *fork_foreign[FORK_FOREIGN_OBJECTS];
+
+void *thread_fork_hold_func(void *arg)
+{
+    arg_t *args = (arg_t *)arg;
+
+    for(int i = 0; i < args->high; i++) ((void **)args->buf)[i] = malloc(100);
+    for(int i = 0; i < args->high; i += 2) free(((void **)args->buf)[i]);
+
+    /* Remote frees - Fewer than the depth, so they stay in our cache */
+    for(int i = 0; i < FORK_FOREIGN_OBJECTS; i++) free(fork_foreign[i]);
+
+    pthread_barrier_wait(&fork_barrier);
+    pthread_barrier_wait(&fork_barrier);
+
+    for(int i = 1; i < args->high; i += 2) free(((void **)args->buf)[i]);
+
+    return NULL;
+}
+
+void *thread_fork_churn_func(void *arg)
+{
+    void *objects[64] = {0};
+    unsigned int seed = 1;
+
+    for(int i = 0; !fork_done; i++)
+    {
+        const int slot = rand_r(&seed) & 63;
+
+        free(objects[slot]);
+        objects[slot] = malloc((slot & 7) ? (size_t)(rand_r(&seed) % 2048) + 1 : (size_t)(rand_r(&seed) % (1 << 20)) + 4096);
+    }
+
+    for(int i = 0; i < 64; i++) free(objects[i]);
+
+    return NULL;
+}
+
+static int fork_child_check(void **held, int objects_num)
+{
+    xmalloc_stats_t before, after;
+    size_t steals_before = 0, steals_after = 0;
+
+    xmalloc_stats_get(&before);
+
+    /* What the holder left is ours to free - Its pageblocks are stolen on the way */
+    for(int i = 1; i < objects_num; i += 2) free(held[i]);
+
+    for(int i = 0; i < objects_num; i++) held[i] = malloc(100);
+    for(int i = 0; i < objects_num; i++) free(held[i]);
+
+    xmalloc_stats_get(&after);
+
+    for(int i = 0; i < XMALLOC_STATS_CLASSES; i++)
+    {
+        steals_before += before.classes[i].steals;
+        steals_after += after.classes[i].steals;
+    }
+
+    /* Only we are left and the pageblocks of the holder were orphaned */
+    return before.threads == 1 && after.threads == 1 && steals_after > steals_before;
+}
+
+int test_fork(int forks, int objects_num)
+{
+    void **buf = malloc(objects_num * sizeof(void *));
+    pthread_t hold_tid, churn_tid;
+    arg_t args = {0};
+    int ret = 1;
+
+    args.high = objects_num;
+    args.buf = buf;
+    fork_done = 0;
+
+    for(int i = 0; i < FORK_FOREIGN_OBJECTS; i++) fork_foreign[i] = malloc(300);
+
+    pthread_barrier_init(&fork_barrier, NULL, 2);
+    pthread_create(&hold_tid, NULL, thread_fork_hold_func, &args);
+    pthread_create(&churn_tid, NULL, thread_fork_churn_func, NULL);
+    pthread_barrier_wait(&fork_barrier);
+
+    for(int i = 0; i < forks && ret; i++)
+    {
+        int status;
+        const pid_t pid = fork();
+
+        if(pid < 0) ret = 0;
+
+        /* The child is killed if it deadlocks */
+        if(!pid)
+        {
+            alarm(10);
+            _exit(!fork_child_check(buf, objects_num));
+        }
+
+        if(pid > 0) ret = waitpid(pid, &status, 0) == pid && WIFEXITED(status) && !WEXITSTATUS(status);
+    }
+
+    fork_done = 1;
+    pthread_barrier_wait(&fork_barrier);
+    pthread_join(hold_tid, NULL);
+    pthread_join(churn_tid, NULL);
+    pthread_barrier_destroy(&fork_barrier);
+    free(buf);
+
+    return ret;
+}
+
+/* Allocates and exits without freeing - Its pageblocks are orphaned with live objects */
+void *thread_heap_report_func(void *arg)
+{
+    arg_t *args = (arg_t *) arg;
+    void **buf = (void **) args->buf;
+
+    for(int i = args->low; i < args->high; i++) buf[i] = malloc(700);
+
+    return NULL;
+}
+
+/* Checks that the classes add up - Capacity over what is out of the pageblocks over what is live */
+static int heap_report_check(const xmalloc_heap_report_t *report)
+{
+    for(int i = 0; i < XMALLOC_STATS_CLASSES; i++)
+    {
+        const xmalloc_heap_class_t *cls = &report->classes[i];
+        const size_t step = cls->object_size - (i ? report->classes[i - 1].object_size : 0);
+
+        if(cls->capacity < cls->allocated_objects || cls->allocated_objects < cls->live_objects ||
+           (cls->live_objects && !cls->pageblocks) || cls->rounding_bytes_estimate != cls->live_objects * (step - 1) / 2)
+        {
+            printf("Class [%zu] does not add up, [%zu] capacity [%zu] allocated [%zu] live\n",
+                   cls->object_size, cls->capacity, cls->allocated_objects, cls->live_objects);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int test_heap_report(int objects_num)
+{
+    xmalloc_heap_report_t before, after;
+    size_t orphans_before = 0, orphans_after = 0, live_before = 0, live_after = 0;
+    void **buf = malloc(objects_num * sizeof(void *));
+    char small[16], *text;
+    pthread_t tid;
+    arg_t args = {0};
+    int len, ret;
+
+    if(!buf || xmalloc_heap_report(&before) || !heap_report_check(&before)) return 0;
+
+    args.high = objects_num;
+    args.buf = buf;
+
+    pthread_create(&tid, NULL, thread_heap_report_func, &args);
+    pthread_join(tid, NULL);
+
+    if(xmalloc_heap_report(&after) || !heap_report_check(&after)) return 0;
+
+    for(int i = 0; i < XMALLOC_STATS_CLASSES; i++)
+    {
+        orphans_before += before.classes[i].orphaned_pageblocks;
+        orphans_after += after.classes[i].orphaned_pageblocks;
+        live_before += before.classes[i].live_objects;
+        live_after += after.classes[i].live_objects;
+    }
+
+    /* The objects of the exited thread are still live, in orphaned pageblocks */
+    ret = after.threads >= 1 && orphans_after > orphans_before && live_after >= live_before + objects_num;
+
+    if(!ret) printf("Orphans [%zu] -> [%zu], live objects [%zu] -> [%zu]\n", orphans_before, orphans_after, live_before, live_after);
+
+    /* Too small a buffer still gets the length of the whole report */
+    len = xmalloc_heap_prometheus(small, sizeof(small));
+    text = (len > 0) ? malloc(len + 1) : NULL;
+
+    ret = ret && text && xmalloc_heap_prometheus(text, len + 1) > 0 &&
+          strstr(text, "\nxmalloc_threads ") &&
+          strstr(text, "xmalloc_class_orphaned_pageblocks{size=\"") &&
+          strstr(text, "xmalloc_class_rounding_bytes_estimate{size=\"") &&
+          strstr(text, "xmalloc_cached_pageblocks{level=\"retired\",pageblock_size=\"");
+
+    free(text);
+
+    for(int i = 0; i < objects_num; i++) free(buf[i]);
+    free(buf);
+
+    return ret;
+}
+
+#ifdef FREE_CHECK_ACTIVE
+/* Frees an object twice in a child - Right after, with another free between, or once it went back to its pageblock */
+static int double_free_child(int pattern)
+{
+    int status;
+    const pid_t pid = fork();
+
+    if(pid < 0) return 0;
+
+    if(!pid)
+    {
+        void *objects[TCACHE_DEPTH + 8];
+        void *volatile twice;
+        const int null_fd = open("/dev/null", O_WRONLY);
+
+        /* The panic message is expected */
+        if(null_fd >= 0) dup2(null_fd, 2);
+
+        for(int i = 0; i < TCACHE_DEPTH + 8; i++) objects[i] = malloc(64);
+
+        /* Hidden from the compiler, which sees the second free coming */
+        twice = objects[0];
+        free(twice);
+
+        switch(pattern)
+        {
+            case 0: break;
+            case 1: free(objects[1]); break;
+            default: for(int i = 1; i < TCACHE_DEPTH + 8; i++) free(objects[i]); break;
+        }
+
+        free(twice);
+        _exit(0);
+    }
+
+    return waitpid(pid, &status, 0) == pid && WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+#endif
+
+/* Double frees abort with the checks on - Also those of objects still in the thread cache */
+int test_double_free(void)
+{
+#ifdef FREE_CHECK_ACTIVE
+    for(int pattern = 0; pattern < 3; pattern++)
+    {
+        if(!double_free_child(pattern))
+        {
+            printf("Double free pattern [%d] was not detected\n", pattern);
+            return 0;
+        }
+    }
+#endif
+
+    return 1;
+}
+
+/* Frees many large allocations of every bin - The bins keep no more than their budgets */
+int test_large_cache_budget(int per_bin)
+{
+    const int sizes_num = 64;
+    void **buf = malloc(sizes_num * per_bin * sizeof(void *));
+    xmalloc_stats_t before, after;
+    int objects_num = 0;
+
+    if(!buf) return 0;
+
+    malloc_trim(0);
+    xmalloc_stats_get(&before);
+
+    /* Sizes up to the largest bin, 1MB - Over all the bins more than both budgets */
+    for(int s = 1; s <= sizes_num; s++)
+    for(int i = 0; i < per_bin; i++)
+        if((buf[objects_num] = malloc(s * (LARGE_CACHE_MAX_PAGES / sizes_num) * PAGE_SZ - 64))) objects_num++;
+
+    for(int i = 0; i < objects_num; i++) free(buf[i]);
+
+    xmalloc_stats_get(&after);
+    free(buf);
+    malloc_trim(0);
+
+    if(after.cached > before.cached + LARGE_LOCAL_CACHE_SZ + LARGE_GLOBAL_CACHE_SZ)
+    {
+        printf("Large bins kept [%zu] bytes\n", after.cached - before.cached);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Frees a spike of objects and then idles until told - No more slow paths, so nothing would purge its caches */
+static pthread_barrier_t idle_barrier;
+
+void *thread_idle_func(void *arg)
+{
+    arg_t *args = (arg_t *) arg;
+    void **buf = (void **) args->buf;
+
+    for(int i = args->low; i < args->high; i++) buf[i] = malloc(200);
+    for(int i = args->low; i < args->high; i++) free(buf[i]);
+
+    pthread_barrier_wait(&idle_barrier);
+    pthread_barrier_wait(&idle_barrier);
+
+    return NULL;
+}
+
+/* Idle threads keep few free pageblocks - The rest went to the global caches, which any thread purges */
+int test_local_cache_depth(int objects_num)
+{
+    void **buf = malloc(objects_num * sizeof(void *));
+    xmalloc_heap_report_t report;
+    size_t thread_cached = 0;
+    pthread_t tid;
+    arg_t args = {0};
+
+    if(!buf) return 0;
+
+    args.high = objects_num;
+    args.buf = buf;
+
+    pthread_barrier_init(&idle_barrier, NULL, 2);
+    pthread_create(&tid, NULL, thread_idle_func, &args);
+    pthread_barrier_wait(&idle_barrier);
+
+    xmalloc_heap_report(&report);
+
+    pthread_barrier_wait(&idle_barrier);
+    pthread_join(tid, NULL);
+    pthread_barrier_destroy(&idle_barrier);
+    free(buf);
+
+    for(int i = 0; i < XMALLOC_PAGE_CLASSES; i++) thread_cached += report.cached_pageblocks[0][i];
+
+    if(thread_cached > report.threads * XMALLOC_PAGE_CLASSES * LOCAL_CACHE_DEPTH)
+    {
+        printf("Threads keep [%zu] free pageblocks\n", thread_cached);
+        return 0;
+    }
+
+    return 1;
+}
+
 /* Test mainly for local frees and local mallocs only and caching */
 int test_local_threads(int threads_num, int alloc_count, int print_flag)
 {
@@ -607,7 +1671,7 @@ int test_remote_threads(int threads_num, int alloc_count)
     }
 
     /* Threads are free to run now */
-    ATOMIC_CAS(&pass, &new, &old);
+    ATOMIC_CAS(&pass, &new, &old, __ATOMIC_SEQ_CST);
 
     for (int i = 0; i < threads_num; i++)
     {
@@ -721,7 +1785,7 @@ int main(int argc, char **argv)
 {
     int ret;
 
-    const int testcases_num = 9;
+    const int testcases_num = 25;
     const char *test_names[] =
     {
         "counting-atomic-LIFO",
@@ -732,6 +1796,22 @@ int main(int argc, char **argv)
         "shuffle-local-threads",
         "shuffle-complex-local-threads",
         "adoption-policy-stress",
+        "large-realloc-integrity",
+        "calloc-zeroed",
+        "trim",
+        "stats",
+        "orphan-adoption",
+        "aligned",
+        "sized-free",
+        "cache-line",
+        "heap-profile",
+        "handoff",
+        "batch",
+        "fork",
+        "heap-report",
+        "double-free",
+        "large-cache-budget",
+        "local-cache-depth",
         "run-all-tests"
     };
 
@@ -739,7 +1819,7 @@ int main(int argc, char **argv)
     int testcase_id = (argc != 2) ? 10000: atoi(argv[1]);
     int break_flag = 1;
 
-    if(testcase_id == 8) /* If we want to run the full testsuite */
+    if(testcase_id == testcases_num - 1) /* If we want to run the full testsuite */
     {
         break_flag = 0;
         testcase_id = 0;
@@ -794,6 +1874,102 @@ int main(int argc, char **argv)
         {
             ret = test_adoption_policy(11, 500000, 10);
             printf("Adoption thread test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 8:
+        {
+            ret = test_large_realloc_integrity(64 << 20);
+            printf("Large realloc integrity test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 9:
+        {
+            ret = test_calloc_zeroed(20);
+            printf("Calloc zeroed test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 10:
+        {
+            ret = test_trim(100000);
+            printf("Trim test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 11:
+        {
+            ret = test_stats(100000);
+            printf("Stats test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 12:
+        {
+            ret = test_orphan_adoption(100000, 10);
+            printf("Orphan adoption test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 13:
+        {
+            ret = test_aligned();
+            printf("Aligned allocations test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 14:
+        {
+            ret = test_sized_free();
+            printf("Sized free test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 15:
+        {
+            ret = test_cache_line();
+            printf("Cache line allocations test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 16:
+        {
+            ret = test_heap_profile();
+            printf("Heap profile test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 17:
+        {
+            ret = test_handoff(20000);
+            printf("Handoff test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 18:
+        {
+            ret = test_batch();
+            printf("Batch allocations test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 19:
+        {
+            ret = test_fork(50, 20000);
+            printf("Fork test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 20:
+        {
+            ret = test_heap_report(20000);
+            printf("Heap report test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 21:
+        {
+            ret = test_double_free();
+            printf("Double free test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 22:
+        {
+            ret = test_large_cache_budget(16);
+            printf("Large cache budget test: [PASSED] = %s\n", ret ? "YES":"NO");
+            if(break_flag) break;
+        }
+        case 23:
+        {
+            ret = test_local_cache_depth(200000);
+            printf("Local cache depth test: [PASSED] = %s\n", ret ? "YES":"NO");
             break;
         }
         default: